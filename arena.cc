@@ -0,0 +1,145 @@
+#include "arena.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cassert>
+
+static uint64_t align_up(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+void* Arena::alloc(uint64_t size, uint64_t align)
+{
+    assert(align && !(align & (align - 1)) && "Alignment must be a power of 2");
+
+    uint64_t start = 0;
+    if (current)
+    {
+        start = align_up((uint64_t)current->data() + used_in_current, align) - (uint64_t)current->data();
+    }
+
+    if (!current || start + size > current->size)
+    {
+        next_block(size + align);
+        start = align_up((uint64_t)current->data(), align) - (uint64_t)current->data();
+    }
+
+    bytes_wasted += start - used_in_current;
+    bytes_used += size;
+
+    used_in_current = start + size;
+    return current->data() + start;
+}
+
+void Arena::next_block(uint64_t min_size)
+{
+    if (current)
+    {
+        bytes_wasted += current->size - used_in_current;
+    }
+
+    // After a reset the old blocks are still in the list, so use them if they're big enough
+    Block* next = current ? current->next : first;
+    if (!next || next->size < min_size)
+    {
+        // Oversized allocations get a block of their own
+        uint64_t size = min_size > block_size ? min_size : block_size;
+
+        Block* new_block = (Block*)malloc(sizeof(Block) + size);
+        assert(new_block && "Out of memory");
+
+        new_block->size = size;
+        new_block->next = next;
+        bytes_reserved += size;
+
+        if (current)
+        {
+            current->next = new_block;
+        }
+        else
+        {
+            first = new_block;
+        }
+
+        next = new_block;
+    }
+
+    current = next;
+    used_in_current = 0;
+}
+
+void Arena::reset()
+{
+    current = nullptr;
+    used_in_current = 0;
+
+    bytes_used = 0;
+    bytes_wasted = 0;
+    last_printed_used = 0;
+    last_printed_wasted = 0;
+}
+
+void Arena::free_all()
+{
+    Block* block = first;
+    while (block)
+    {
+        Block* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    first = nullptr;
+    bytes_reserved = 0;
+    reset();
+}
+
+void Arena::adopt(Arena& other)
+{
+    if (!other.first) return;
+
+    // Blocks before current count as in use, so put other's blocks at the front.
+    // If we haven't allocated anything, carry on from where other left off,
+    // so its remaining space gets used.
+    Block* last = other.first;
+    while (last->next)
+    {
+        last = last->next;
+    }
+    last->next = first;
+    first = other.first;
+
+    if (!current)
+    {
+        current = other.current;
+        used_in_current = other.used_in_current;
+    }
+    else if (other.current)
+    {
+        bytes_wasted += other.current->size - other.used_in_current;
+    }
+
+    bytes_used += other.bytes_used;
+    bytes_wasted += other.bytes_wasted;
+    bytes_reserved += other.bytes_reserved;
+
+    other.first = nullptr;
+    other.current = nullptr;
+    other.used_in_current = 0;
+    other.bytes_used = 0;
+    other.bytes_wasted = 0;
+    other.bytes_reserved = 0;
+}
+
+void Arena::print_stats(const char* phase)
+{
+    std::cout << "arena [" << phase << "]: "
+              << bytes_used - last_printed_used << " bytes used, "
+              << bytes_wasted - last_printed_wasted << " wasted ("
+              << bytes_used << " used, " << bytes_wasted << " wasted, "
+              << bytes_reserved << " reserved in total)" << std::endl;
+
+    last_printed_used = bytes_used;
+    last_printed_wasted = bytes_wasted;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <new>
+
+// Bump allocator which grows in large blocks. Allocations are never moved, so
+// pointers into the arena stay valid until it is reset or freed.
+struct Arena
+{
+    struct Block
+    {
+        Block* next;
+        uint64_t size;
+
+        uint8_t* data()
+        {
+            return (uint8_t*)(this + 1);
+        }
+    };
+
+    static const uint64_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+    uint64_t block_size = DEFAULT_BLOCK_SIZE;
+
+    Block* first = nullptr;
+    Block* current = nullptr;
+    uint64_t used_in_current = 0;
+
+    // Statistics
+    uint64_t bytes_used = 0;        // Requested by allocations
+    uint64_t bytes_wasted = 0;      // Alignment padding and unused block tails
+    uint64_t bytes_reserved = 0;    // Total size of all blocks
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
+    {
+        free_all();
+    }
+
+    void* alloc(uint64_t size, uint64_t align);
+
+    // Default constructs each element
+    template <typename T>
+    T* alloc_array(uint64_t count)
+    {
+        T* result = (T*)alloc(sizeof(T) * count, alignof(T));
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            new (result + i) T();
+        }
+        return result;
+    }
+
+    // Makes all memory available again, but keeps the blocks to be reused
+    void reset();
+
+    // Returns all blocks to the system
+    void free_all();
+
+    // Takes all of other's blocks, so its allocations live as long as this arena's.
+    // Other is left empty.
+    void adopt(Arena& other);
+
+    // Prints statistics since the last time this was called
+    void print_stats(const char* phase);
+
+private:
+    uint64_t last_printed_used = 0;
+    uint64_t last_printed_wasted = 0;
+
+    void next_block(uint64_t min_size);
+};
@@ -0,0 +1,661 @@
+#include "ast_cache.h"
+#include "intern.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Bump this whenever the layout below or any of the node structs change
+constexpr uint32_t AST_CACHE_FORMAT = 3;
+constexpr uint32_t AST_CACHE_MAGIC = 0x43414248;    // "HBAC"
+
+constexpr uint32_t NO_SYMBOL = UINT32_MAX;
+
+// An entry is the header, then each section in this order. Nodes are written
+// field by field into structs without padding, so the same AST always gives the
+// same bytes. Plain nodes have no padding to begin with and are stored as they
+// are in memory. Everything else refers to symbols and text by index.
+struct CacheHeader
+{
+    uint32_t magic;
+    uint32_t format;
+    uint64_t key;
+    uint32_t source_len;
+    NodeRef start;
+    uint32_t pool_sizes[ASTPool::Count];
+    uint32_t symbol_count;
+    uint32_t param_type_count;  // Over all function signatures
+    uint32_t text_len;          // Symbol names and string literals
+};
+
+static_assert(sizeof(ASTNode) == 3 * sizeof(uint32_t), "ASTNode has padding");
+
+struct CachedBinOpNode
+{
+    ASTNode node;
+    uint32_t op;
+    uint32_t type_id;
+    uint32_t is_signed;
+};
+
+struct CachedNumberNode
+{
+    ASTNode node;
+    uint32_t type_id;
+    uint64_t value;
+};
+
+static_assert(sizeof(CachedBinOpNode) == 6 * sizeof(uint32_t), "CachedBinOpNode has padding");
+static_assert(sizeof(CachedNumberNode) == 4 * sizeof(uint32_t) + sizeof(uint64_t), "CachedNumberNode has padding");
+
+struct CachedIdentifierNode
+{
+    ASTNode node;
+    uint32_t symbol;
+};
+
+struct CachedStringNode
+{
+    ASTNode node;
+    uint32_t text_offset;
+    uint32_t len;
+};
+
+struct CachedSymbol
+{
+    uint32_t name_offset;
+    uint32_t name_len;
+    uint32_t type_id;
+
+    // Only if this is a function. param_count is NO_SYMBOL otherwise.
+    // Function type ids depend on the order types were interned in, so the
+    // signature is stored instead and interned again when loading.
+    uint32_t return_type;
+    uint32_t param_count;
+    uint32_t first_param_type;
+};
+
+// Sections are padded so each one starts 8 byte aligned in the mapping
+static uint64_t align_section(uint64_t size)
+{
+    return (size + 7) & ~7ull;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void* data, uint64_t len)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (uint64_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Any change to the compiler binary changes its size or modification time,
+// so that stands in for a version number
+static bool compute_key(const SourceFile& source, uint32_t options, uint64_t& key)
+{
+    struct stat exe;
+    if (stat("/proc/self/exe", &exe) != 0) return false;
+
+    uint64_t exe_id[] = {
+        (uint64_t)exe.st_ino,
+        (uint64_t)exe.st_size,
+        (uint64_t)exe.st_mtim.tv_sec,
+        (uint64_t)exe.st_mtim.tv_nsec,
+    };
+
+    key = 14695981039346656037ull;
+    key = fnv1a(key, &AST_CACHE_FORMAT, sizeof(AST_CACHE_FORMAT));
+    key = fnv1a(key, exe_id, sizeof(exe_id));
+    key = fnv1a(key, &options, sizeof(options));
+    key = fnv1a(key, source.data, source.len);
+
+    return true;
+}
+
+static std::string entry_path(const char* cache_dir, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.hbast", (unsigned long long)key);
+    return std::string(cache_dir) + name;
+}
+
+// ---------------
+// Loading entries
+// ---------------
+
+struct CacheReader
+{
+    const uint8_t* position;
+    const uint8_t* end;
+
+    // Returns null if the entry is too short
+    template <typename T>
+    const T* take(uint64_t count)
+    {
+        if ((uint64_t)(end - position) / sizeof(T) < count) return nullptr;
+
+        uint64_t size = align_section(sizeof(T) * count);
+        if (size > (uint64_t)(end - position)) return nullptr;
+
+        const T* result = (const T*)position;
+        position += size;
+        return result;
+    }
+};
+
+static bool is_valid_ref(NodeRef ref, const CacheHeader& header)
+{
+    uint32_t pool = ref >> NODE_POOL_SHIFT;
+    uint32_t index = ref & NODE_INDEX_MASK;
+
+    if (ref == NO_NODE) return true;
+    if (pool >= ASTPool::Count) return false;
+    return index < header.pool_sizes[pool];
+}
+
+// The pool the parser puts nodes of this type in
+static uint32_t node_type_pool(uint32_t type)
+{
+    switch (type)
+    {
+        case ASTNodeType::BinaryOperator:
+            return ASTPool::BinOp;
+        case ASTNodeType::Number:
+            return ASTPool::Number;
+        case ASTNodeType::String:
+            return ASTPool::String;
+        case ASTNodeType::StatementList:
+            return ASTPool::StatementList;
+        case ASTNodeType::Identifier:
+        case ASTNodeType::FunctionDef:
+        case ASTNodeType::FunctionParameter:
+        case ASTNodeType::VariableDef:
+        case ASTNodeType::Assignment:
+            return ASTPool::Identifier;
+        default:
+            return ASTPool::Plain;
+    }
+}
+
+// Nodes are cast by their type, so a node in the wrong pool would be read as the wrong struct
+static bool is_valid_node(const ASTNode& node, uint32_t pool, const CacheHeader& header)
+{
+    return node.type < ASTNodeType::Count
+        && node_type_pool(node.type) == pool
+        && is_valid_ref(node.child, header)
+        && is_valid_ref(node.sibling, header);
+}
+
+template <typename T>
+static bool are_valid_nodes(const T* nodes, uint32_t count, uint32_t pool, const CacheHeader& header)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!is_valid_node(nodes[i], pool, header)) return false;
+    }
+    return true;
+}
+
+static bool is_valid_text(uint32_t offset, uint32_t len, const CacheHeader& header)
+{
+    return offset <= header.text_len && len <= header.text_len - offset;
+}
+
+// The sections of each pool in a mapped entry
+struct CachedPools
+{
+    const ASTNode* plain;
+    const CachedBinOpNode* binop;
+    const CachedNumberNode* number;
+    const CachedIdentifierNode* identifier;
+    const CachedStringNode* string;
+    const ASTNode* statement_list;
+
+    // ref has to be valid and not NO_NODE
+    const ASTNode& node(NodeRef ref) const
+    {
+        uint32_t index = ref & NODE_INDEX_MASK;
+        switch (ref >> NODE_POOL_SHIFT)
+        {
+            case ASTPool::BinOp:
+                return binop[index].node;
+            case ASTPool::Number:
+                return number[index].node;
+            case ASTPool::Identifier:
+                return identifier[index].node;
+            case ASTPool::String:
+                return string[index].node;
+            case ASTPool::StatementList:
+                return statement_list[index];
+            default:
+                return plain[index];
+        }
+    }
+};
+
+// True if no node reachable from start is reached twice, so there are no cycles.
+// Every ref must already be valid.
+static bool is_tree(const CachedPools& pools, const CacheHeader& header)
+{
+    std::vector<uint8_t> visited[ASTPool::Count];
+    for (uint32_t pool = 0; pool < ASTPool::Count; ++pool)
+    {
+        visited[pool].resize(header.pool_sizes[pool], 0);
+    }
+
+    // Function bodies can be nested arbitrarily deep, so walk them with an explicit stack
+    std::vector<NodeRef> stack(1, header.start);
+    while (!stack.empty())
+    {
+        NodeRef ref = stack.back();
+        stack.pop_back();
+        if (ref == NO_NODE) continue;
+
+        uint8_t& seen = visited[ref >> NODE_POOL_SHIFT][ref & NODE_INDEX_MASK];
+        if (seen) return false;
+        seen = 1;
+
+        const ASTNode& node = pools.node(ref);
+        stack.push_back(node.sibling);
+        stack.push_back(node.child);
+    }
+    return true;
+}
+
+template <typename T>
+static void copy_pool(std::vector<T>& pool, const T* nodes, uint32_t count)
+{
+    pool.resize(count, T(0));
+    memcpy(pool.data(), nodes, sizeof(T) * count);
+}
+
+// Checks the whole entry before touching the AST, so a stale or damaged entry is just a miss
+static bool read_entry(CacheReader reader, uint64_t key, const SourceFile& source, AST& ast)
+{
+    const CacheHeader* header = reader.take<CacheHeader>(1);
+    if (!header
+        || header->magic != AST_CACHE_MAGIC
+        || header->format != AST_CACHE_FORMAT
+        || header->key != key
+        || header->source_len != source.len
+        || header->pool_sizes[ASTPool::Plain] == 0
+        || !is_valid_ref(header->start, *header))
+    {
+        return false;
+    }
+
+    const uint32_t* sizes = header->pool_sizes;
+
+    const ASTNode* plain_nodes = reader.take<ASTNode>(sizes[ASTPool::Plain]);
+    const CachedBinOpNode* binop_nodes = reader.take<CachedBinOpNode>(sizes[ASTPool::BinOp]);
+    const CachedNumberNode* number_nodes = reader.take<CachedNumberNode>(sizes[ASTPool::Number]);
+    const CachedIdentifierNode* identifier_nodes = reader.take<CachedIdentifierNode>(sizes[ASTPool::Identifier]);
+    const CachedStringNode* string_nodes = reader.take<CachedStringNode>(sizes[ASTPool::String]);
+    const ASTNode* statement_list_nodes = reader.take<ASTNode>(sizes[ASTPool::StatementList]);
+    const CachedSymbol* symbols = reader.take<CachedSymbol>(header->symbol_count);
+    const uint32_t* param_types = reader.take<uint32_t>(header->param_type_count);
+    const char* text = reader.take<char>(header->text_len);
+
+    if (!plain_nodes || !binop_nodes || !number_nodes || !identifier_nodes || !string_nodes
+        || !statement_list_nodes || !symbols || !param_types || !text)
+    {
+        return false;
+    }
+
+    if (!are_valid_nodes(plain_nodes, sizes[ASTPool::Plain], ASTPool::Plain, *header)
+        || !are_valid_nodes(statement_list_nodes, sizes[ASTPool::StatementList], ASTPool::StatementList, *header))
+    {
+        return false;
+    }
+
+    // Only builtin type ids are stored, the rest aren't the same from run to run
+    for (uint32_t i = 0; i < sizes[ASTPool::BinOp]; ++i)
+    {
+        const CachedBinOpNode& cached = binop_nodes[i];
+        if (!is_valid_node(cached.node, ASTPool::BinOp, *header)) return false;
+        if (cached.type_id >= TypeId::Count || cached.is_signed > 1) return false;
+    }
+
+    for (uint32_t i = 0; i < sizes[ASTPool::Number]; ++i)
+    {
+        const CachedNumberNode& cached = number_nodes[i];
+        if (!is_valid_node(cached.node, ASTPool::Number, *header)) return false;
+        if (cached.type_id >= TypeId::Count) return false;
+    }
+
+    for (uint32_t i = 0; i < header->param_type_count; ++i)
+    {
+        if (param_types[i] >= TypeId::Count) return false;
+    }
+
+    for (uint32_t i = 0; i < sizes[ASTPool::Identifier]; ++i)
+    {
+        const CachedIdentifierNode& cached = identifier_nodes[i];
+        if (!is_valid_node(cached.node, ASTPool::Identifier, *header)) return false;
+        if (cached.symbol != NO_SYMBOL && cached.symbol >= header->symbol_count) return false;
+    }
+
+    for (uint32_t i = 0; i < sizes[ASTPool::String]; ++i)
+    {
+        const CachedStringNode& cached = string_nodes[i];
+        if (!is_valid_node(cached.node, ASTPool::String, *header)) return false;
+        if (!is_valid_text(cached.text_offset, cached.len, *header)) return false;
+    }
+
+    for (uint32_t i = 0; i < header->symbol_count; ++i)
+    {
+        const CachedSymbol& cached = symbols[i];
+        if (!is_valid_text(cached.name_offset, cached.name_len, *header)) return false;
+        if (cached.type_id >= TypeId::Count || cached.return_type >= TypeId::Count) return false;
+
+        if (cached.param_count != NO_SYMBOL
+            && (cached.first_param_type > header->param_type_count
+                || cached.param_count > header->param_type_count - cached.first_param_type))
+        {
+            return false;
+        }
+    }
+
+    // Everything reachable from start has to be a tree, or walking it would never end
+    CachedPools pools = {plain_nodes, binop_nodes, number_nodes, identifier_nodes, string_nodes, statement_list_nodes};
+    if (!is_tree(pools, *header))
+    {
+        return false;
+    }
+
+    // The entry is good, now build the AST from it
+    ast.reset();
+    ast.start = header->start;
+
+    copy_pool(ast.plain_nodes, plain_nodes, sizes[ASTPool::Plain]);
+
+    ast.binop_nodes.reserve(sizes[ASTPool::BinOp]);
+    for (uint32_t i = 0; i < sizes[ASTPool::BinOp]; ++i)
+    {
+        const CachedBinOpNode& cached = binop_nodes[i];
+
+        ASTBinOpNode node(cached.op);
+        node.child = cached.node.child;
+        node.sibling = cached.node.sibling;
+        node.type_id = cached.type_id;
+        node.is_signed = cached.is_signed;
+        ast.binop_nodes.push_back(node);
+    }
+
+    ast.number_nodes.reserve(sizes[ASTPool::Number]);
+    for (uint32_t i = 0; i < sizes[ASTPool::Number]; ++i)
+    {
+        const CachedNumberNode& cached = number_nodes[i];
+
+        ASTNumberNode node(cached.value);
+        node.child = cached.node.child;
+        node.sibling = cached.node.sibling;
+        node.type_id = cached.type_id;
+        ast.number_nodes.push_back(node);
+    }
+
+    // String literals and names are copied out, since the mapping goes away after loading
+    char* text_copy = (char*)ast.arena.alloc(header->text_len, 1);
+    memcpy(text_copy, text, header->text_len);
+
+    SymbolData* symbol_data = ast.arena.alloc_array<SymbolData>(header->symbol_count);
+    for (uint32_t i = 0; i < header->symbol_count; ++i)
+    {
+        const CachedSymbol& cached = symbols[i];
+        SymbolData& symbol = symbol_data[i];
+
+        SubString name;
+        name.start = text_copy + cached.name_offset;
+        name.len = cached.name_len;
+
+        symbol.name_id = interner_g.intern(name);
+        symbol.name = interner_g.get(symbol.name_id);
+        symbol.type_id = cached.type_id;
+
+        if (cached.param_count != NO_SYMBOL)
+        {
+            symbol.type_id = type_table_g.function(cached.return_type, param_types + cached.first_param_type, cached.param_count);
+        }
+    }
+
+    ast.identifier_nodes.reserve(sizes[ASTPool::Identifier]);
+    for (uint32_t i = 0; i < sizes[ASTPool::Identifier]; ++i)
+    {
+        const CachedIdentifierNode& cached = identifier_nodes[i];
+
+        SymbolData* symbol = cached.symbol == NO_SYMBOL ? nullptr : &symbol_data[cached.symbol];
+        ASTIdentifierNode node(cached.node.type, symbol);
+        node.child = cached.node.child;
+        node.sibling = cached.node.sibling;
+        ast.identifier_nodes.push_back(node);
+    }
+
+    ast.string_nodes.reserve(sizes[ASTPool::String]);
+    for (uint32_t i = 0; i < sizes[ASTPool::String]; ++i)
+    {
+        const CachedStringNode& cached = string_nodes[i];
+
+        SubString str;
+        str.start = text_copy + cached.text_offset;
+        str.len = cached.len;
+
+        ASTStringNode node(str);
+        node.child = cached.node.child;
+        node.sibling = cached.node.sibling;
+        ast.string_nodes.push_back(node);
+    }
+
+    ast.statement_list_nodes.reserve(sizes[ASTPool::StatementList]);
+    for (uint32_t i = 0; i < sizes[ASTPool::StatementList]; ++i)
+    {
+        ASTStatementListNode node;
+        node.child = statement_list_nodes[i].child;
+        node.sibling = statement_list_nodes[i].sibling;
+        ast.statement_list_nodes.push_back(node);
+    }
+
+    return true;
+}
+
+bool load_cached_ast(const char* cache_dir, const SourceFile& source, uint32_t options, AST& ast)
+{
+    uint64_t key;
+    if (!compute_key(source, options, key)) return false;
+
+    std::string path = entry_path(cache_dir, key);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    CacheReader reader;
+    reader.position = (const uint8_t*)mapping;
+    reader.end = reader.position + st.st_size;
+
+    bool result = read_entry(reader, key, source, ast);
+
+    munmap(mapping, st.st_size);
+    return result;
+}
+
+// ---------------
+// Writing entries
+// ---------------
+
+template <typename T>
+static void append(std::vector<uint8_t>& out, const T* data, uint64_t count)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    out.insert(out.end(), bytes, bytes + sizeof(T) * count);
+    out.resize(align_section(out.size()), 0);
+}
+
+static uint32_t append_text(std::string& text, SubString str)
+{
+    uint32_t offset = text.size();
+    text.append(str.start, str.len);
+    return offset;
+}
+
+static bool write_file(const char* path, const std::vector<uint8_t>& data)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    uint64_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t amount = write(fd, data.data() + written, data.size() - written);
+        if (amount < 0)
+        {
+            if (errno == EINTR) continue;
+            close(fd);
+            return false;
+        }
+        written += amount;
+    }
+
+    return close(fd) == 0;
+}
+
+void save_cached_ast(const char* cache_dir, const SourceFile& source, uint32_t options, AST& ast)
+{
+    uint64_t key;
+    if (!compute_key(source, options, key)) return;
+
+    // Number the symbols in the order they're first referenced
+    std::unordered_map<const SymbolData*, uint32_t> symbol_indices;
+    std::vector<const SymbolData*> symbols;
+    for (const ASTIdentifierNode& node : ast.identifier_nodes)
+    {
+        if (node.symbol && symbol_indices.emplace(node.symbol, symbols.size()).second)
+        {
+            symbols.push_back(node.symbol);
+        }
+    }
+
+    std::string text;
+    std::vector<uint32_t> param_types;
+    std::vector<CachedSymbol> cached_symbols;
+    for (const SymbolData* symbol : symbols)
+    {
+        CachedSymbol cached = {};
+        cached.name_len = symbol->name.len;
+        cached.name_offset = append_text(text, symbol->name);
+        cached.type_id = symbol->type_id;
+        cached.param_count = NO_SYMBOL;
+
+        if (type_table_g.is_function(symbol->type_id))
+        {
+            const TypeInfo& info = type_table_g.get(symbol->type_id);
+            cached.type_id = TypeId::Invalid;
+            cached.return_type = info.base;
+            cached.param_count = info.param_count;
+            cached.first_param_type = param_types.size();
+            param_types.insert(param_types.end(), info.param_types, info.param_types + info.param_count);
+        }
+
+        cached_symbols.push_back(cached);
+    }
+
+    std::vector<CachedBinOpNode> binop_nodes;
+    for (const ASTBinOpNode& node : ast.binop_nodes)
+    {
+        CachedBinOpNode cached;
+        cached.node = node;
+        cached.op = node.op;
+        cached.type_id = node.type_id;
+        cached.is_signed = node.is_signed;
+        binop_nodes.push_back(cached);
+    }
+
+    std::vector<CachedNumberNode> number_nodes;
+    for (const ASTNumberNode& node : ast.number_nodes)
+    {
+        CachedNumberNode cached;
+        cached.node = node;
+        cached.type_id = node.type_id;
+        cached.value = node.value;
+        number_nodes.push_back(cached);
+    }
+
+    std::vector<CachedIdentifierNode> identifier_nodes;
+    for (const ASTIdentifierNode& node : ast.identifier_nodes)
+    {
+        CachedIdentifierNode cached;
+        cached.node = node;
+        cached.symbol = node.symbol ? symbol_indices[node.symbol] : NO_SYMBOL;
+        identifier_nodes.push_back(cached);
+    }
+
+    std::vector<CachedStringNode> string_nodes;
+    for (const ASTStringNode& node : ast.string_nodes)
+    {
+        CachedStringNode cached;
+        cached.node = node;
+        cached.len = node.str.len;
+        cached.text_offset = append_text(text, node.str);
+        string_nodes.push_back(cached);
+    }
+
+    std::vector<ASTNode> statement_list_nodes(ast.statement_list_nodes.begin(), ast.statement_list_nodes.end());
+
+    // Zeroed including the padding at the end, so it doesn't end up in the file
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = AST_CACHE_MAGIC;
+    header.format = AST_CACHE_FORMAT;
+    header.key = key;
+    header.source_len = source.len;
+    header.start = ast.start;
+    header.pool_sizes[ASTPool::Plain] = ast.plain_nodes.size();
+    header.pool_sizes[ASTPool::BinOp] = ast.binop_nodes.size();
+    header.pool_sizes[ASTPool::Number] = ast.number_nodes.size();
+    header.pool_sizes[ASTPool::Identifier] = ast.identifier_nodes.size();
+    header.pool_sizes[ASTPool::String] = ast.string_nodes.size();
+    header.pool_sizes[ASTPool::StatementList] = ast.statement_list_nodes.size();
+    header.symbol_count = cached_symbols.size();
+    header.param_type_count = param_types.size();
+    header.text_len = text.size();
+
+    std::vector<uint8_t> out;
+    append(out, &header, 1);
+    append(out, ast.plain_nodes.data(), ast.plain_nodes.size());
+    append(out, binop_nodes.data(), binop_nodes.size());
+    append(out, number_nodes.data(), number_nodes.size());
+    append(out, identifier_nodes.data(), identifier_nodes.size());
+    append(out, string_nodes.data(), string_nodes.size());
+    append(out, statement_list_nodes.data(), statement_list_nodes.size());
+    append(out, cached_symbols.data(), cached_symbols.size());
+    append(out, param_types.data(), param_types.size());
+    append(out, text.data(), text.size());
+
+    // Write to a temporary first, so another compile never sees half an entry
+    mkdir(cache_dir, 0777);
+    std::string path = entry_path(cache_dir, key);
+    std::string temp_path = path + "." + std::to_string(getpid());
+
+    if (!write_file(temp_path.c_str(), out) || rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        unlink(temp_path.c_str());
+    }
+}
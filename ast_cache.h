@@ -0,0 +1,20 @@
+#pragma once
+
+#include "source_file.h"
+#include "parser.h"
+
+// Caches type checked ASTs on disk, so unchanged files can skip lexing, parsing
+// and type checking. Entries are keyed by a hash of the source text and the
+// compiler executable, so rebuilding the compiler invalidates the whole cache.
+//
+// Only what codegen needs is kept: the node pools, and the symbols they refer to.
+// Scopes are not restored, so a loaded AST can't be parsed into any further.
+
+// options is anything besides the source that changes the resulting AST,
+// such as lazy parsing, and is part of the key.
+
+// Returns false if there is no valid entry for this source, leaving the AST untouched.
+bool load_cached_ast(const char* cache_dir, const SourceFile& source, uint32_t options, AST& ast);
+
+// Failing to write the cache is not an error, the entry is just skipped.
+void save_cached_ast(const char* cache_dir, const SourceFile& source, uint32_t options, AST& ast);
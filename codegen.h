@@ -1,4 +1,55 @@
 #pragma once
 #include "parser.h"
 
-void output_ast(AST& ast);
+#include <string>
+
+struct CodegenOptions
+{
+    // Like -O0 to -O3. At 0 no passes are run at all.
+    uint32_t opt_level = 0;
+
+    // Pass pipeline in opt's -passes syntax, run instead of the default pipeline for opt_level
+    const char* passes = nullptr;
+
+    // Print how long each pass took to stdout
+    bool time_passes = false;
+
+    // Writes an object file here instead of printing IR, if set
+    const char* object_path = nullptr;
+
+    // Target triple and CPU to generate code for. The triple defaults to the host's,
+    // and a CPU of "native" means the host CPU along with all of its features.
+    const char* target_triple = nullptr;
+    const char* cpu = nullptr;
+
+    // When writing an object file, the functions are split into up to this many
+    // partitions, generated on their own threads and combined at the end.
+    uint32_t codegen_threads = 1;
+};
+
+// Prints IR to stderr, or writes an object file to options.object_path.
+// Returns false with a message in error if it can't.
+bool output_ast(AST& ast, const CodegenOptions& options, std::string* error);
+
+// Writes an object file to options.object_path without LLVM, for fast unoptimized builds.
+// Only the object path is used from the options.
+// Returns false with a message in error if it can't.
+bool output_ast_x64(AST& ast, const CodegenOptions& options, std::string* error);
+
+// JIT compiles the AST and calls main with args, putting main's result in result,
+// or 0 if it doesn't return anything. Arguments are truncated to main's parameter types.
+// Externals such as puts are looked up in this process, so anything linked
+// into the program embedding the compiler can be called.
+// Returns false with a message in error if the program can't be compiled or run.
+bool run_ast(AST& ast, const CodegenOptions& options, const int64_t* args, uint32_t arg_count, int64_t* result, std::string* error);
+
+// Like run_ast, but lowers the AST to bytecode and interprets it instead of
+// JIT compiling, so it starts up instantly. Externals are looked up in this process too.
+// Returns false with a message in error if the program can't be run or overflows the stack.
+bool interpret_ast(AST& ast, const int64_t* args, uint32_t arg_count, int64_t* result, std::string* error);
+
+// Evaluates expr with the interpreter, so constant folding gets exactly the
+// semantics the program would have at run time. expr may only contain numbers
+// and operators, which must already be type checked. The result is extended to
+// 64 bits by expr's type. Returns false if expr can't be evaluated on its own.
+bool evaluate_constant(AST& ast, ASTNode* expr, int64_t* result);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace llvm
+{
+    class Value;
+}
+
+// Per symbol state for whichever backend is generating the symbol's function
+union SymbolData_Codegen
+{
+    llvm::Value* value;         // LLVM: current value of a variable
+    int32_t frame_offset;       // x86-64: stack slot of a variable, from rbp
+    uint32_t register_index;    // Interpreter: register holding a variable
+};
@@ -1,5 +1,5 @@
 #include "codegen.h"
-#include "codegen_llvm.h"
+#include "link.h"
 
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/raw_ostream.h>
@@ -9,8 +9,27 @@
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/IR/PassTimingInfo.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
 
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 // for interfacing with llvm
@@ -19,63 +38,107 @@ static llvm::StringRef make_twine(SubString substr)
     return llvm::StringRef(substr.start, substr.len);
 }
 
-static llvm::Type* get_type(uint32_t type_id, llvm::LLVMContext& llvm_ctxt)
-{
-    switch (type_id)
-    {
-        case TypeId::U8:
-        case TypeId::I8:
-            return llvm::Type::getInt8Ty(llvm_ctxt);
-        case TypeId::U16:
-        case TypeId::I16:
-            return llvm::Type::getInt16Ty(llvm_ctxt);
-        case TypeId::U32:
-        case TypeId::I32:
-            return llvm::Type::getInt32Ty(llvm_ctxt);
-        case TypeId::U64:
-        case TypeId::I64:
-            return llvm::Type::getInt64Ty(llvm_ctxt);
-        case TypeId::Pointer:
-            return llvm::Type::getInt8PtrTy(llvm_ctxt);
-        case TypeId::None:
-            return llvm::Type::getVoidTy(llvm_ctxt);
-        default:
-            return nullptr;
-    }
-}
+// Splitting codegen up further isn't worth it for fewer functions than this
+constexpr uint32_t MIN_FUNCTIONS_PER_PARTITION = 64;
 
-struct PhiNode
-{
-    llvm::Value* original_value = nullptr;
-    llvm::Value* new_value = nullptr;
-    SymbolData* symbol = nullptr;
-    llvm::PHINode* llvm_phi = nullptr;
-    PhiNode* parent_phi = nullptr;
-};
+// Entry point added for running main in the JIT
+static const char* RUN_MAIN_NAME = "hb.run_main";
 
 struct CodeEmitter
 {
-    llvm::LLVMContext llvm_ctxt;
+    llvm::LLVMContext& llvm_ctxt;
     llvm::IRBuilder<> ir_builder;
-    llvm::Module* module;
+    std::unique_ptr<llvm::Module> module;
+    AST& ast;
+
+    // Indexed by type id, null until first used
+    std::vector<llvm::Type*> llvm_types;
 
-    CodeEmitter()
-    :ir_builder(llvm_ctxt)
+    // Phis created in the current function, checked for uses once it's done
+    std::vector<llvm::PHINode*> phis;
+
+    // Scratch space for find_assigned
+    std::vector<SymbolData*> defined_symbols;
+    std::unordered_set<SymbolData*> seen_symbols;
+
+    // Scratch space for emit_subexpr. Each frame is an operator or call whose
+    // operand values are on the value stack from value_base up.
+    struct SubexprFrame
+    {
+        ASTNode* expr;
+        ASTNode* next_operand;
+        uint32_t value_base;
+    };
+    std::vector<SubexprFrame> subexpr_frames;
+    std::vector<llvm::Value*> subexpr_values;
+
+    CodeEmitter(AST& ast_, llvm::LLVMContext& llvm_ctxt_)
+    :llvm_ctxt(llvm_ctxt_),
+    ir_builder(llvm_ctxt),
+    module(new llvm::Module("top", llvm_ctxt)),
+    ast(ast_)
+    {}
+
+    llvm::Type* get_type(uint32_t type_id)
     {
-        module = new llvm::Module("top", llvm_ctxt);
+        if (type_id >= llvm_types.size())
+        {
+            llvm_types.resize(type_table_g.size(), nullptr);
+        }
+
+        // make_type can recurse back into here, so don't hold a reference into the cache
+        if (!llvm_types[type_id])
+        {
+            llvm::Type* type = make_type(type_id);
+            llvm_types[type_id] = type;
+        }
+        return llvm_types[type_id];
     }
 
-    ~CodeEmitter()
+    llvm::Type* make_type(uint32_t type_id)
     {
-        delete module;
+        const TypeInfo& info = type_table_g.get(type_id);
+        switch (info.kind)
+        {
+            case TypeKind::Pointer:
+                return get_type(info.base)->getPointerTo();
+            case TypeKind::Function: {
+                std::vector<llvm::Type*> param_types;
+                for (uint32_t i = 0; i < info.param_count; ++i)
+                {
+                    param_types.push_back(get_type(info.param_types[i]));
+                }
+                return llvm::FunctionType::get(get_type(info.base), param_types, false);
+            }
+            default:
+                break;
+        }
+
+        switch (type_id)
+        {
+            case TypeId::U8:
+            case TypeId::I8:
+                return llvm::Type::getInt8Ty(llvm_ctxt);
+            case TypeId::U16:
+            case TypeId::I16:
+                return llvm::Type::getInt16Ty(llvm_ctxt);
+            case TypeId::U32:
+            case TypeId::I32:
+                return llvm::Type::getInt32Ty(llvm_ctxt);
+            case TypeId::U64:
+            case TypeId::I64:
+                return llvm::Type::getInt64Ty(llvm_ctxt);
+            case TypeId::Bool:
+                return llvm::Type::getInt1Ty(llvm_ctxt);
+            case TypeId::None:
+                return llvm::Type::getVoidTy(llvm_ctxt);
+            default:
+                return nullptr;
+        }
     }
 
-    llvm::Value* emit_binop(ASTBinOpNode* subexpr, SymbolData* symbol)
+    llvm::Value* emit_binop(ASTBinOpNode* subexpr, llvm::Value* lhs, llvm::Value* rhs, SymbolData* symbol)
     {
-        ASTNode* operand = subexpr->child;
-        llvm::Value* lhs = emit_subexpr(operand, nullptr);
-        llvm::Value* rhs = emit_subexpr(operand->sibling, nullptr);
-
         SubString value_name;
         if (symbol)
         {
@@ -106,26 +169,28 @@ struct CodeEmitter
         return nullptr;
     }
 
-    llvm::Value* emit_call(ASTNode* call_node, SymbolData* symbol)
+    llvm::Value* emit_call(ASTNode* call_node, llvm::Value* const* arg_values, uint32_t arg_count, SymbolData* symbol)
     {
         assert(call_node->type == ASTNodeType::FunctionCall);
 
-        llvm::Function* function = module->getFunction(make_twine(static_cast<ASTIdentifierNode*>(call_node->child)->symbol->name));
-        assert(function && "Unknown function referenced");
+        SymbolData* function_symbol = static_cast<ASTIdentifierNode*>(ast.child(call_node))->symbol;
+        llvm::Function* function = module->getFunction(make_twine(function_symbol->name));
+        if (!function)
+        {
+            // Defined in another partition's module, so declare it here
+            llvm::FunctionType* function_type = llvm::cast<llvm::FunctionType>(get_type(function_symbol->type_id));
+            function = llvm::Function::Create(function_type, llvm::Function::ExternalLinkage, make_twine(function_symbol->name), module.get());
+        }
 
-        std::vector<llvm::Value*> arg_values;
+        assert((arg_count == function->arg_size()) && "Incorrect number of arguments");
 
-        ASTNode* arg_node = call_node->child->sibling;
-        while (arg_node)
+        SubString value_name;
+        if (symbol)
         {
-            arg_values.push_back(emit_subexpr(arg_node, nullptr));
-            arg_node = arg_node->sibling;
+            value_name = symbol->name;
         }
 
-        assert((arg_values.size() == function->arg_size()) && "Incorrect number of arguments");
-
-        // TODO: Need to check it symbol is null, right?
-        return ir_builder.CreateCall(function, arg_values, make_twine(symbol->name));
+        return ir_builder.CreateCall(function, llvm::ArrayRef<llvm::Value*>(arg_values, arg_count), make_twine(value_name));
     }
 
     llvm::Value* emit_string(ASTStringNode* string, SymbolData* symbol)
@@ -148,228 +213,382 @@ struct CodeEmitter
         return ir_builder.CreateGlobalStringPtr(make_twine(new_substr), make_twine(value_name));
     }
 
-    llvm::Value* emit_subexpr(ASTNode* subexpr, SymbolData* symbol)
+    // Pushes the value of a leaf onto the value stack, or opens a frame for an operator or call
+    void begin_subexpr(ASTNode* subexpr, SymbolData* symbol)
     {
-        llvm::Value* result;
         switch (subexpr->type)
         {
             case ASTNodeType::Identifier:
-                result = (llvm::Value*)static_cast<ASTIdentifierNode*>(subexpr)->symbol->codegen_data->new_value;
-                break;
-            case ASTNodeType::Number:
-                // TODO: after type checking the number will actually have a type, so don't hardcode
-                result = llvm::ConstantInt::get(get_type(TypeId::U32, llvm_ctxt), static_cast<ASTNumberNode*>(subexpr)->value);
-                break;
-            case ASTNodeType::BinaryOperator:
-                result = emit_binop(static_cast<ASTBinOpNode*>(subexpr), symbol);
-                break;
-            case ASTNodeType::FunctionCall:
-                result = emit_call(subexpr, symbol);
+                subexpr_values.push_back(static_cast<ASTIdentifierNode*>(subexpr)->symbol->codegen_data.value);
                 break;
+            case ASTNodeType::Number: {
+                ASTNumberNode* number = static_cast<ASTNumberNode*>(subexpr);
+                subexpr_values.push_back(llvm::ConstantInt::get(get_type(number->type_id), number->value));
+            } break;
             case ASTNodeType::String:
-                result = emit_string(static_cast<ASTStringNode*>(subexpr), symbol);
+                subexpr_values.push_back(emit_string(static_cast<ASTStringNode*>(subexpr), symbol));
                 break;
+            case ASTNodeType::BinaryOperator: {
+                SubexprFrame frame = {subexpr, ast.child(subexpr), (uint32_t)subexpr_values.size()};
+                subexpr_frames.push_back(frame);
+            } break;
+            case ASTNodeType::FunctionCall: {
+                // The first child is the function, the rest are arguments
+                SubexprFrame frame = {subexpr, ast.sibling(ast.child(subexpr)), (uint32_t)subexpr_values.size()};
+                subexpr_frames.push_back(frame);
+            } break;
             default:
                 assert(false && "Invalid syntax tree - expected a subexpression");
         }
-
-        return result;
     }
 
-    void emit_variable_def(ASTIdentifierNode* identifier_node, Array<PhiNode>* phi_nodes)
+    // Operands are emitted before the operator using them, in order. Expressions can be
+    // nested arbitrarily deep, so this keeps an explicit stack instead of recursing.
+    // Only the outermost value is named after symbol.
+    llvm::Value* emit_subexpr(ASTNode* subexpr, SymbolData* symbol)
     {
-        SymbolData* symbol = identifier_node->symbol;
-        PhiNode new_phi;
-        new_phi.symbol = symbol;
-        new_phi.new_value = emit_subexpr(identifier_node->child, symbol);;
+        subexpr_frames.clear();
+        subexpr_values.clear();
+
+        begin_subexpr(subexpr, symbol);
+        while (!subexpr_frames.empty())
+        {
+            SubexprFrame& frame = subexpr_frames.back();
+            if (frame.next_operand)
+            {
+                ASTNode* operand = frame.next_operand;
+                frame.next_operand = ast.sibling(operand);
+                begin_subexpr(operand, nullptr);
+                continue;
+            }
+
+            // Every operand's value is on the stack now
+            SubexprFrame done = frame;
+            subexpr_frames.pop_back();
 
-        // Note: It is correct to leave original_value as default,
-        // since it should only be set to the value from BEFORE block.
+            SymbolData* value_symbol = subexpr_frames.empty() ? symbol : nullptr;
+            llvm::Value** operands = subexpr_values.data() + done.value_base;
+            uint32_t operand_count = subexpr_values.size() - done.value_base;
 
-        symbol->codegen_data = phi_nodes->push(new_phi);
+            llvm::Value* result;
+            if (done.expr->type == ASTNodeType::BinaryOperator)
+            {
+                result = emit_binop(static_cast<ASTBinOpNode*>(done.expr), operands[0], operands[1], value_symbol);
+            }
+            else
+            {
+                result = emit_call(done.expr, operands, operand_count, value_symbol);
+            }
+
+            subexpr_values.resize(done.value_base);
+            subexpr_values.push_back(result);
+        }
+
+        assert(subexpr_values.size() == 1);
+        return subexpr_values.back();
     }
 
-    void emit_statement(ASTNode* statement, Array<PhiNode>* phi_nodes)
+    void emit_variable_def(ASTIdentifierNode* identifier_node)
     {
-        switch (statement->type)
+        SymbolData* symbol = identifier_node->symbol;
+        symbol->codegen_data.value = emit_subexpr(ast.child(identifier_node), symbol);
+    }
+
+    void find_assigned_in_list(ASTNode* statement_list, std::vector<SymbolData*>& assigned)
+    {
+        for (ASTNode* statement = ast.child(statement_list); statement; statement = ast.sibling(statement))
         {
-            case ASTNodeType::VariableDef:
-            {
-                emit_variable_def(static_cast<ASTIdentifierNode*>(statement), phi_nodes);
-            } break;
-            case ASTNodeType::Assignment:
+            switch (statement->type)
             {
-                SymbolData* symbol = static_cast<ASTIdentifierNode*>(statement)->symbol;
-                symbol->codegen_data->new_value = emit_subexpr(statement->child, symbol);
-            } break;
-            case ASTNodeType::FunctionDef:
-                // do nothing
-                break;
-            case ASTNodeType::Return:
-            {
-                if (statement->child)
-                {
-                    llvm::Value* ret_value = emit_subexpr(statement->child, nullptr);
-                    ir_builder.CreateRet(ret_value);
-                }
-                else
-                {
-                    // Not returning a value;
-                    ir_builder.CreateRetVoid();
-                }
-            } break;
-            case ASTNodeType::If:
+                case ASTNodeType::Assignment:
+                    assigned.push_back(static_cast<ASTIdentifierNode*>(statement)->symbol);
+                    break;
+                case ASTNodeType::VariableDef:
+                    defined_symbols.push_back(static_cast<ASTIdentifierNode*>(statement)->symbol);
+                    break;
+                case ASTNodeType::If:
+                case ASTNodeType::While:
+                    for (ASTNode* block = ast.sibling(ast.child(statement)); block; block = ast.sibling(block))
+                    {
+                        find_assigned_in_list(block, assigned);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Finds the variables from outside an if or while which are assigned in it,
+    // since they are the only ones that can need phis. Only statements are visited,
+    // assignments can't be in expressions.
+    // The order is the order of the first assignments, so the output is deterministic.
+    void find_assigned(ASTNode* statement, std::vector<SymbolData*>& assigned)
+    {
+        assert(defined_symbols.empty() && seen_symbols.empty());
+
+        std::vector<SymbolData*> all_assigned;
+        for (ASTNode* block = ast.sibling(ast.child(statement)); block; block = ast.sibling(block))
+        {
+            find_assigned_in_list(block, all_assigned);
+        }
+
+        seen_symbols.insert(defined_symbols.begin(), defined_symbols.end());
+        for (SymbolData* symbol : all_assigned)
+        {
+            if (seen_symbols.insert(symbol).second)
             {
-                bool has_else = (bool)statement->child->sibling->sibling;
+                assigned.push_back(symbol);
+            }
+        }
 
-                llvm::BasicBlock* before_block = ir_builder.GetInsertBlock();
-                llvm::Function* function = before_block->getParent();
+        defined_symbols.clear();
+        seen_symbols.clear();
+    }
 
-                llvm::BasicBlock* then_block = llvm::BasicBlock::Create(llvm_ctxt, "then", function);
-                llvm::BasicBlock* else_block = has_else ? llvm::BasicBlock::Create(llvm_ctxt, "else", function) : nullptr;
-                llvm::BasicBlock* fi_block = llvm::BasicBlock::Create(llvm_ctxt, "end_if", function);
+    llvm::PHINode* create_phi(SymbolData* symbol)
+    {
+        llvm::PHINode* phi = ir_builder.CreatePHI(get_type(symbol->type_id), 2, make_twine(symbol->name));
+        phis.push_back(phi);
+        return phi;
+    }
 
-                if (!else_block) else_block = fi_block;
+    // True once the block being emitted into has returned, so nothing can follow in it
+    bool block_ended()
+    {
+        return ir_builder.GetInsertBlock()->getTerminator() != nullptr;
+    }
 
-                llvm::Value* condition_value = emit_subexpr(statement->child, nullptr);
-                ir_builder.CreateCondBr(condition_value, then_block, else_block);
+    void emit_if(ASTNode* statement)
+    {
+        ASTNode* then_list = ast.sibling(ast.child(statement));
+        ASTNode* else_list = ast.sibling(then_list);
 
-                // Create new phi nodes
+        llvm::BasicBlock* before_block = ir_builder.GetInsertBlock();
+        llvm::Function* function = before_block->getParent();
 
-                size_t phi_frame_base = phi_nodes->length;
-                ir_builder.SetInsertPoint(fi_block);
+        llvm::BasicBlock* then_block = llvm::BasicBlock::Create(llvm_ctxt, "then", function);
+        llvm::BasicBlock* else_block = else_list ? llvm::BasicBlock::Create(llvm_ctxt, "else", function) : nullptr;
+        llvm::BasicBlock* fi_block = llvm::BasicBlock::Create(llvm_ctxt, "end_if", function);
 
-                for (size_t i = 0; i < phi_frame_base; ++i)
-                {
-                    PhiNode* phi = &(*phi_nodes)[i];
-                    PhiNode* new_phi = phi_nodes->push(*phi);
-                    new_phi->original_value = new_phi->new_value;
-                    new_phi->parent_phi = phi;
-                    new_phi->llvm_phi = ir_builder.CreatePHI(get_type(new_phi->symbol->type_id, llvm_ctxt), 2, make_twine(new_phi->symbol->name));
-
-                    // The value of the phi node itself is the new value
-                    // for the symol.
-                    phi->new_value = new_phi->llvm_phi;
-
-                    // Point symbol to new phi node
-                    new_phi->symbol->codegen_data = new_phi;
-                }
+        if (!else_block) else_block = fi_block;
 
-                Array<PhiNode> inner_phi_nodes;
-                inner_phi_nodes.data = phi_nodes->data + phi_frame_base;
-                inner_phi_nodes.length = phi_nodes->length - phi_frame_base;
-                inner_phi_nodes.max_length = phi_nodes->max_length - phi_frame_base;
+        llvm::Value* condition_value = emit_subexpr(ast.child(statement), nullptr);
+        ir_builder.CreateCondBr(condition_value, then_block, else_block);
 
-                // Emit then
+        std::vector<SymbolData*> assigned;
+        find_assigned(statement, assigned);
 
-                ir_builder.SetInsertPoint(then_block);
-                emit_statement_list(statement->child->sibling, inner_phi_nodes);
-                ir_builder.CreateBr(fi_block);
+        std::vector<llvm::Value*> before_values;
+        for (SymbolData* symbol : assigned)
+        {
+            before_values.push_back(symbol->codegen_data.value);
+        }
 
-                // Update then block, since it might have changed
-                then_block = ir_builder.GetInsertBlock();
+        // Emit then. An arm which returned doesn't reach the end, so it
+        // gets no branch there and doesn't give the phis a value.
+        ir_builder.SetInsertPoint(then_block);
+        emit_statement_list(then_list);
+        bool then_ended = block_ended();
+        if (!then_ended) ir_builder.CreateBr(fi_block);
 
-                // Update phi nodes
-                for (PhiNode& phi : inner_phi_nodes)
-                {
-                    phi.llvm_phi->addIncoming(phi.new_value, then_block);
-                    phi.new_value = phi.original_value;
-                }
+        // Update then block, since it might have changed
+        then_block = ir_builder.GetInsertBlock();
 
-                if (has_else)
-                {
-                    // Emit else
-                    ir_builder.SetInsertPoint(else_block);
-                    emit_statement_list(statement->child->sibling->sibling, inner_phi_nodes);
-                    ir_builder.CreateBr(fi_block);
+        std::vector<llvm::Value*> then_values;
+        for (size_t i = 0; i < assigned.size(); ++i)
+        {
+            then_values.push_back(assigned[i]->codegen_data.value);
+            assigned[i]->codegen_data.value = before_values[i];
+        }
 
-                    // Update else block, since it might have changed
-                    else_block = ir_builder.GetInsertBlock();
+        bool else_ended = false;
+        if (else_list)
+        {
+            ir_builder.SetInsertPoint(else_block);
+            emit_statement_list(else_list);
+            else_ended = block_ended();
+            if (!else_ended) ir_builder.CreateBr(fi_block);
 
-                    // Update phi nodes
-                    for (PhiNode& phi : inner_phi_nodes)
-                    {
-                        phi.llvm_phi->addIncoming(phi.new_value, else_block);
-                        phi.new_value = phi.original_value;
-                    }
-                }
-                else
-                {
-                    // There is no else block.
-                    for (PhiNode& phi : inner_phi_nodes)
-                    {
-                        phi.llvm_phi->addIncoming(phi.original_value, before_block);
-                    }
-                }
+            // Update else block, since it might have changed
+            else_block = ir_builder.GetInsertBlock();
+        }
+        else
+        {
+            else_block = before_block;
+        }
 
-                // Point symbols back to their original phis
-                for (PhiNode& phi : inner_phi_nodes)
-                {
-                    phi.symbol->codegen_data = phi.parent_phi;
-                }
+        // Both arms returned, so nothing after the if is reached. The insert
+        // point stays in the ended else block, so the rest of the list is skipped.
+        if (then_ended && else_ended)
+        {
+            fi_block->eraseFromParent();
+            return;
+        }
 
-                ir_builder.SetInsertPoint(fi_block);
-            } break;
-            case ASTNodeType::While:
+        // Without an else, the variables still have their values from before
+        ir_builder.SetInsertPoint(fi_block);
+        for (size_t i = 0; i < assigned.size(); ++i)
+        {
+            llvm::Value* else_value = assigned[i]->codegen_data.value;
+            if (then_ended || then_values[i] == else_value)
+            {
+                continue;
+            }
+            if (else_ended)
             {
-                llvm::Function* function = ir_builder.GetInsertBlock()->getParent();
-                llvm::BasicBlock* before_block = ir_builder.GetInsertBlock();
-                llvm::BasicBlock* do_block = llvm::BasicBlock::Create(llvm_ctxt, "do", function);
-                llvm::BasicBlock* fi_block = llvm::BasicBlock::Create(llvm_ctxt, "end_do", function);
+                assigned[i]->codegen_data.value = then_values[i];
+                continue;
+            }
 
-                llvm::Value* condition_value = emit_subexpr(statement->child, nullptr);
-                ir_builder.CreateCondBr(condition_value, do_block, fi_block);
+            llvm::PHINode* phi = create_phi(assigned[i]);
+            phi->addIncoming(then_values[i], then_block);
+            phi->addIncoming(else_value, else_block);
+            assigned[i]->codegen_data.value = phi;
+        }
+    }
 
-                // Create new phi nodes
+    void emit_while(ASTNode* statement)
+    {
+        llvm::Function* function = ir_builder.GetInsertBlock()->getParent();
+        llvm::BasicBlock* before_block = ir_builder.GetInsertBlock();
+        llvm::BasicBlock* do_block = llvm::BasicBlock::Create(llvm_ctxt, "do", function);
+        llvm::BasicBlock* fi_block = llvm::BasicBlock::Create(llvm_ctxt, "end_do", function);
 
-                size_t phi_frame_base = phi_nodes->length;
-                ir_builder.SetInsertPoint(do_block);
+        llvm::Value* condition_value = emit_subexpr(ast.child(statement), nullptr);
+        ir_builder.CreateCondBr(condition_value, do_block, fi_block);
 
-                for (size_t i = 0; i < phi_frame_base; ++i)
-                {
-                    PhiNode* phi = &(*phi_nodes)[i];
-                    PhiNode* new_phi = phi_nodes->push(*phi);
-                    new_phi->original_value = new_phi->new_value;
-                    new_phi->parent_phi = phi;
+        std::vector<SymbolData*> assigned;
+        find_assigned(statement, assigned);
 
-                    // The llvm phi node has to be created up here so that is emitted in the right place
-                    new_phi->llvm_phi = ir_builder.CreatePHI(get_type(new_phi->symbol->type_id, llvm_ctxt), 2, make_twine(new_phi->symbol->name));
-                    new_phi->new_value = new_phi->llvm_phi;
+        // The loop phis have to be created before the body, since the body uses them
+        ir_builder.SetInsertPoint(do_block);
 
-                    // Point symbol to new phi node
-                    new_phi->symbol->codegen_data = new_phi;
-                }
+        std::vector<llvm::Value*> before_values;
+        std::vector<llvm::PHINode*> loop_phis;
+        for (SymbolData* symbol : assigned)
+        {
+            before_values.push_back(symbol->codegen_data.value);
+
+            llvm::PHINode* phi = create_phi(symbol);
+            phi->addIncoming(symbol->codegen_data.value, before_block);
+            loop_phis.push_back(phi);
+            symbol->codegen_data.value = phi;
+        }
 
-                Array<PhiNode> inner_phi_nodes;
-                inner_phi_nodes.data = phi_nodes->data + phi_frame_base;
-                inner_phi_nodes.length = phi_nodes->length - phi_frame_base;
-                inner_phi_nodes.max_length = phi_nodes->max_length - phi_frame_base;
+        emit_statement_list(ast.sibling(ast.child(statement)));
 
-                emit_statement_list(statement->child->sibling, inner_phi_nodes);
+        // A body which returned has no back edge, so every loop phi is redundant
+        // and the loop is left with the values from before it.
+        bool body_ended = block_ended();
 
-                do_block = ir_builder.GetInsertBlock();
-                for (const PhiNode& phi : inner_phi_nodes)
+        // A phi is redundant if its symbol was only assigned the value it already had.
+        // Other symbols can hold the phi too, like z after z = x; x = x; so every
+        // symbol is remapped before any incoming values are added, and the phis
+        // are only erased once nothing refers to them.
+        std::vector<bool> redundant(assigned.size(), false);
+        for (size_t i = 0; i < assigned.size(); ++i)
+        {
+            if (body_ended || assigned[i]->codegen_data.value == loop_phis[i])
+            {
+                redundant[i] = true;
+                loop_phis[i]->replaceAllUsesWith(before_values[i]);
+            }
+        }
+
+        for (SymbolData* symbol : assigned)
+        {
+            for (size_t j = 0; j < assigned.size(); ++j)
+            {
+                if (redundant[j] && symbol->codegen_data.value == loop_phis[j])
                 {
-                    phi.llvm_phi->addIncoming(phi.original_value, before_block);
-                    phi.llvm_phi->addIncoming(phi.new_value, do_block);
+                    symbol->codegen_data.value = before_values[j];
                 }
+            }
+        }
 
-                llvm::Value* end_condition_value = emit_subexpr(statement->child, nullptr);
-                ir_builder.CreateCondBr(end_condition_value, do_block, fi_block);
+        // The body can end in a different block, which is where the back edge comes from
+        llvm::BasicBlock* do_end_block = ir_builder.GetInsertBlock();
+        for (size_t i = 0; i < assigned.size(); ++i)
+        {
+            if (!redundant[i])
+            {
+                loop_phis[i]->addIncoming(assigned[i]->codegen_data.value, do_end_block);
+            }
+        }
 
-                ir_builder.SetInsertPoint(fi_block);
+        if (!body_ended)
+        {
+            llvm::Value* end_condition_value = emit_subexpr(ast.child(statement), nullptr);
+            ir_builder.CreateCondBr(end_condition_value, do_block, fi_block);
+        }
 
-                for (const PhiNode& phi : inner_phi_nodes)
-                {
-                    llvm::PHINode* llvm_phi = ir_builder.CreatePHI(get_type(phi.symbol->type_id, llvm_ctxt), 2, make_twine(phi.symbol->name));
+        ir_builder.SetInsertPoint(fi_block);
 
-                    llvm_phi->addIncoming(phi.original_value, before_block);
-                    llvm_phi->addIncoming(phi.new_value, do_block);
+        for (size_t i = 0; i < assigned.size(); ++i)
+        {
+            llvm::Value* end_value = assigned[i]->codegen_data.value;
+            if (body_ended)
+            {
+                assigned[i]->codegen_data.value = before_values[i];
+                continue;
+            }
+            if (end_value == before_values[i])
+            {
+                continue;
+            }
+
+            llvm::PHINode* phi = create_phi(assigned[i]);
+            phi->addIncoming(before_values[i], before_block);
+            phi->addIncoming(end_value, do_end_block);
+            assigned[i]->codegen_data.value = phi;
+        }
 
-                    phi.parent_phi->new_value = llvm_phi;
-                    phi.symbol->codegen_data = phi.parent_phi;
+        for (size_t i = 0; i < assigned.size(); ++i)
+        {
+            if (redundant[i])
+            {
+                phis.erase(std::find(phis.begin(), phis.end(), loop_phis[i]));
+                loop_phis[i]->eraseFromParent();
+            }
+        }
+    }
+
+    void emit_statement(ASTNode* statement)
+    {
+        switch (statement->type)
+        {
+            case ASTNodeType::VariableDef:
+            {
+                emit_variable_def(static_cast<ASTIdentifierNode*>(statement));
+            } break;
+            case ASTNodeType::Assignment:
+            {
+                SymbolData* symbol = static_cast<ASTIdentifierNode*>(statement)->symbol;
+                symbol->codegen_data.value = emit_subexpr(ast.child(statement), symbol);
+            } break;
+            case ASTNodeType::FunctionDef:
+                // do nothing
+                break;
+            case ASTNodeType::Return:
+            {
+                if (ast.child(statement))
+                {
+                    llvm::Value* ret_value = emit_subexpr(ast.child(statement), nullptr);
+                    ir_builder.CreateRet(ret_value);
+                }
+                else
+                {
+                    // Not returning a value;
+                    ir_builder.CreateRetVoid();
                 }
             } break;
+            case ASTNodeType::If:
+                emit_if(statement);
+                break;
+            case ASTNodeType::While:
+                emit_while(statement);
+                break;
             default:
             {
                 // This must be an expression-statement
@@ -382,71 +601,77 @@ struct CodeEmitter
         }
     }
 
-    // Takes phi_nodes by value because we don't want any new symbols propagating back
-    // to the outer scope
-    void emit_statement_list(ASTNode* statement_list, Array<PhiNode> phi_nodes)
+    void emit_statement_list(ASTNode* statement_list)
     {
         assert(statement_list->type == ASTNodeType::StatementList);
 
-        ASTNode* statement = statement_list->child;
+        ASTNode* statement = ast.child(statement_list);
 
-        while(statement)
+        // Anything after a return can't be reached
+        while(statement && !block_ended())
         {
-            emit_statement(statement, &phi_nodes);
-            statement = statement->sibling;
+            emit_statement(statement);
+            statement = ast.sibling(statement);
         }
     }
 
-    void generate_function_def(ASTNode* function_def_node)
+    // Removes phis with no uses, along with any phis only they used
+    void remove_dead_phis()
     {
-        ASTNode* parameter_list = function_def_node->child;
-        assert(parameter_list && parameter_list->type == ASTNodeType::ParameterList);
-
-        std::vector<llvm::Type*> arg_types;
+        std::unordered_set<llvm::PHINode*> removed;
+        while (!phis.empty())
         {
-            ASTNode* parameter = parameter_list->child;
-            while (parameter)
+            llvm::PHINode* phi = phis.back();
+            phis.pop_back();
+
+            if (removed.count(phi) || !phi->use_empty())
             {
-                arg_types.push_back(get_type(static_cast<ASTIdentifierNode*>(parameter)->symbol->type_id, llvm_ctxt));
-                parameter = parameter->sibling;
+                continue;
             }
+
+            for (llvm::Value* incoming : phi->incoming_values())
+            {
+                if (llvm::PHINode* incoming_phi = llvm::dyn_cast<llvm::PHINode>(incoming))
+                {
+                    phis.push_back(incoming_phi);
+                }
+            }
+
+            phi->eraseFromParent();
+            removed.insert(phi);
         }
+    }
 
-        llvm::FunctionType* function_type = llvm::FunctionType::get(get_type(static_cast<ASTIdentifierNode*>(function_def_node)->symbol->function_info->return_type, llvm_ctxt), arg_types, false);
+    void generate_function_def(ASTNode* function_def_node)
+    {
+        ASTNode* parameter_list = ast.child(function_def_node);
+        assert(parameter_list && parameter_list->type == ASTNodeType::ParameterList);
+
+        llvm::FunctionType* function_type = llvm::cast<llvm::FunctionType>(get_type(static_cast<ASTIdentifierNode*>(function_def_node)->symbol->type_id));
         llvm::Function* function = llvm::Function::Create(
             function_type,
             llvm::Function::ExternalLinkage,
             make_twine(static_cast<ASTIdentifierNode*>(function_def_node)->symbol->name),
-            module
+            module.get()
         );
 
-        Array<PhiNode> phi_nodes;
-        phi_nodes.data = new PhiNode[MAX_SYMBOLS];
-        phi_nodes.length = 0;
-        phi_nodes.max_length = MAX_SYMBOLS;
-
         // set function arg names and values
         {
-            ASTIdentifierNode* parameter = static_cast<ASTIdentifierNode*>(function_def_node->child->child);
+            ASTIdentifierNode* parameter = static_cast<ASTIdentifierNode*>(ast.child(ast.child(function_def_node)));
             auto arg = function->arg_begin();
             while (parameter)
             {
                 assert(arg != function->arg_end());
 
                 arg->setName(make_twine(parameter->symbol->name));
+                parameter->symbol->codegen_data.value = &(*arg);    // convert iterator to pointer
 
-                PhiNode new_phi;
-                new_phi.symbol = parameter->symbol;
-                new_phi.new_value = &(*arg);    // convert iterator to pointer
-
-                parameter->symbol->codegen_data = phi_nodes.push(new_phi);
-
-                parameter = static_cast<ASTIdentifierNode*>(parameter->sibling);
+                parameter = static_cast<ASTIdentifierNode*>(ast.sibling(parameter));
                 ++arg;
             }
         }
 
-        ASTStatementListNode* statement_list = static_cast<ASTStatementListNode*>(function_def_node->child->sibling);
+        ASTStatementListNode* statement_list = static_cast<ASTStatementListNode*>(ast.sibling(ast.child(function_def_node)));
 
         if (statement_list)
         {
@@ -455,18 +680,86 @@ struct CodeEmitter
             llvm::BasicBlock* entry = llvm::BasicBlock::Create(llvm_ctxt, "entry", function);
             ir_builder.SetInsertPoint(entry);
 
-            emit_statement_list(statement_list, phi_nodes);
+            emit_statement_list(statement_list);
+
+            // Falling off the end returns nothing, or 0 like the interpreter
+            if (!block_ended())
+            {
+                if (function->getReturnType()->isVoidTy())
+                {
+                    ir_builder.CreateRetVoid();
+                }
+                else
+                {
+                    ir_builder.CreateRet(llvm::Constant::getNullValue(function->getReturnType()));
+                }
+            }
 
-            llvm::verifyFunction(*function);
+            remove_dead_phis();
         }
     }
+
+    // Generates RUN_MAIN_NAME, which takes main's arguments as an array of
+    // i64 and returns main's result as an i64, so callers don't need to know
+    // main's signature at compile time.
+    void generate_run_main(SymbolData* main_symbol)
+    {
+        llvm::Function* main_function = module->getFunction(make_twine(main_symbol->name));
+        const TypeInfo& main_type = type_table_g.get(main_symbol->type_id);
+
+        llvm::Type* i64 = llvm::Type::getInt64Ty(llvm_ctxt);
+        llvm::FunctionType* run_main_type = llvm::FunctionType::get(i64, {i64->getPointerTo()}, false);
+        llvm::Function* run_main = llvm::Function::Create(run_main_type, llvm::Function::ExternalLinkage, RUN_MAIN_NAME, module.get());
+
+        ir_builder.SetInsertPoint(llvm::BasicBlock::Create(llvm_ctxt, "entry", run_main));
+
+        std::vector<llvm::Value*> args;
+        for (uint32_t i = 0; i < main_type.param_count; ++i)
+        {
+            llvm::Value* arg_ptr = ir_builder.CreateConstGEP1_32(i64, run_main->getArg(0), i);
+            llvm::Value* arg = ir_builder.CreateLoad(i64, arg_ptr);
+
+            llvm::Type* param_type = get_type(main_type.param_types[i]);
+            if (param_type->isPointerTy())
+            {
+                args.push_back(ir_builder.CreateIntToPtr(arg, param_type));
+            }
+            else
+            {
+                args.push_back(ir_builder.CreateIntCast(arg, param_type, false));
+            }
+        }
+
+        llvm::Value* result = ir_builder.CreateCall(main_function, args);
+        if (main_type.base == TypeId::None)
+        {
+            result = llvm::ConstantInt::get(i64, 0);
+        }
+        else if (result->getType()->isPointerTy())
+        {
+            result = ir_builder.CreatePtrToInt(result, i64);
+        }
+        else
+        {
+            result = ir_builder.CreateIntCast(result, i64, is_signed_integer(main_type.base));
+        }
+        ir_builder.CreateRet(result);
+    }
 };
 
-void output_ast(AST& ast)
+// Functions in a partition must be in the order they're defined,
+// so every callee is either already in the module or declared in another partition.
+static void generate_partition(CodeEmitter& emitter, ASTNode* const* functions, uint32_t count)
 {
-    CodeEmitter emitter;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        emitter.generate_function_def(functions[i]);
+    }
+}
 
-    ASTNode* node = ast.start;
+static void generate_module(CodeEmitter& emitter, AST& ast)
+{
+    ASTNode* node = ast.node(ast.start);
     while (node)
     {
         switch (node->type)
@@ -478,10 +771,398 @@ void output_ast(AST& ast)
                 assert(false);  // unsupported
         }
 
-        node = node->sibling;
+        node = ast.sibling(node);
+    }
+}
+
+// Invalid IR is a bug in codegen, and LLVM's passes can silently miscompile it,
+// so nothing is optimized, emitted or run from a module which fails this.
+// Returns false with the verifier's report in error.
+static bool verify_module(llvm::Module& module, std::string* error)
+{
+    std::string report;
+    llvm::raw_string_ostream report_stream(report);
+    if (!llvm::verifyModule(module, &report_stream))
+    {
+        return true;
     }
 
-    llvm::verifyModule(*emitter.module);
+    *error = "Generated invalid IR:\n" + report_stream.str();
+    return false;
+}
+
+static llvm::Error make_error(const std::string& message)
+{
+    return llvm::make_error<llvm::StringError>(message, llvm::inconvertibleErrorCode());
+}
+
+// Puts the message in error and returns false if there was one
+static bool succeeded(llvm::Error result, std::string* error)
+{
+    if (!result)
+    {
+        return true;
+    }
+
+    *error = llvm::toString(std::move(result));
+    return false;
+}
+
+static llvm::CodeGenOpt::Level codegen_opt_level(uint32_t opt_level)
+{
+    static const llvm::CodeGenOpt::Level LEVELS[] = {
+        llvm::CodeGenOpt::None,
+        llvm::CodeGenOpt::Less,
+        llvm::CodeGenOpt::Default,
+        llvm::CodeGenOpt::Aggressive,
+    };
+    assert(opt_level < 4);
+    return LEVELS[opt_level];
+}
+
+// Leaves target_machine null if no target was asked for, in which case IR is output target independent
+// Safe to call from several threads at once
+static llvm::Error create_target_machine(const CodegenOptions& options, std::unique_ptr<llvm::TargetMachine>& target_machine)
+{
+    if (!options.object_path && !options.target_triple && !options.cpu)
+    {
+        return llvm::Error::success();
+    }
+
+    static std::once_flag targets_initialized;
+    std::call_once(targets_initialized, []()
+    {
+        llvm::InitializeAllTargetInfos();
+        llvm::InitializeAllTargets();
+        llvm::InitializeAllTargetMCs();
+        llvm::InitializeAllAsmPrinters();
+    });
+
+    std::string triple = options.target_triple ? llvm::Triple::normalize(options.target_triple) : llvm::sys::getDefaultTargetTriple();
+
+    std::string error;
+    const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target)
+    {
+        return make_error("Unknown target: " + error);
+    }
+
+    std::string cpu = options.cpu ? options.cpu : "generic";
+    std::string features;
+    if (cpu == "native")
+    {
+        cpu = llvm::sys::getHostCPUName().str();
+
+        llvm::StringMap<bool> host_features;
+        if (llvm::sys::getHostCPUFeatures(host_features))
+        {
+            llvm::SubtargetFeatures feature_list;
+            for (const auto& feature : host_features)
+            {
+                feature_list.AddFeature(feature.first(), feature.second);
+            }
+            features = feature_list.getString();
+        }
+    }
+
+
+    // PIC, since the system linker makes position independent executables by default
+    target_machine.reset(target->createTargetMachine(triple, cpu, features, llvm::TargetOptions(), llvm::Reloc::PIC_, llvm::None, codegen_opt_level(options.opt_level)));
+    return llvm::Error::success();
+}
+
+static llvm::Error emit_object_file(llvm::Module& module, llvm::TargetMachine& target_machine, const char* path)
+{
+    std::error_code error;
+    llvm::raw_fd_ostream out(path, error, llvm::sys::fs::OF_None);
+    if (error)
+    {
+        return make_error("Couldn't open " + std::string(path) + ": " + error.message());
+    }
+
+    // Machine code generation is still on the legacy pass manager
+    llvm::legacy::PassManager passes;
+    bool not_supported = target_machine.addPassesToEmitFile(passes, out, nullptr, llvm::CGFT_ObjectFile);
+    assert(!not_supported && "Target can't emit object files");
+    (void)not_supported;
+
+    passes.run(module);
+    return llvm::Error::success();
+}
+
+static llvm::Error optimize_module(llvm::Module& module, llvm::TargetMachine* target_machine, const CodegenOptions& options)
+{
+    if (options.opt_level == 0 && !options.passes)
+    {
+        return llvm::Error::success();
+    }
+
+    llvm::PassInstrumentationCallbacks instrumentation;
+    llvm::TimePassesHandler pass_timer(options.time_passes);
+    pass_timer.setOutStream(llvm::outs());
+    pass_timer.registerCallbacks(instrumentation);
+
+    llvm::PassBuilder pass_builder(target_machine, llvm::PipelineTuningOptions(), llvm::None, &instrumentation);
+
+    llvm::LoopAnalysisManager loop_analyses;
+    llvm::FunctionAnalysisManager function_analyses;
+    llvm::CGSCCAnalysisManager cgscc_analyses;
+    llvm::ModuleAnalysisManager module_analyses;
+    pass_builder.registerModuleAnalyses(module_analyses);
+    pass_builder.registerCGSCCAnalyses(cgscc_analyses);
+    pass_builder.registerFunctionAnalyses(function_analyses);
+    pass_builder.registerLoopAnalyses(loop_analyses);
+    pass_builder.crossRegisterProxies(loop_analyses, function_analyses, cgscc_analyses, module_analyses);
+
+    llvm::ModulePassManager passes;
+    if (options.passes)
+    {
+        if (llvm::Error error = pass_builder.parsePassPipeline(passes, options.passes))
+        {
+            return make_error("Invalid pass pipeline: " + llvm::toString(std::move(error)));
+        }
+    }
+    else
+    {
+        static const llvm::OptimizationLevel LEVELS[] = {
+            llvm::OptimizationLevel::O0,
+            llvm::OptimizationLevel::O1,
+            llvm::OptimizationLevel::O2,
+            llvm::OptimizationLevel::O3,
+        };
+        assert(options.opt_level < 4);
+        passes = pass_builder.buildPerModuleDefaultPipeline(LEVELS[options.opt_level]);
+    }
+
+    passes.run(module, module_analyses);
+
+    // Partitions are optimized in parallel, so don't mix up their reports
+    static std::mutex print_mutex;
+    std::lock_guard<std::mutex> lock(print_mutex);
+    pass_timer.print();
+    return llvm::Error::success();
+}
+
+// Lowers, optimizes and emits the functions to an object file, in a context of its own.
+// Leaves a message in error if it fails.
+static void emit_partition(AST& ast, ASTNode* const* functions, uint32_t count, const CodegenOptions& options, const char* path, std::string* error)
+{
+    llvm::LLVMContext llvm_ctxt;
+    CodeEmitter emitter(ast, llvm_ctxt);
+    generate_partition(emitter, functions, count);
+
+    if (!verify_module(*emitter.module, error))
+    {
+        return;
+    }
+
+    std::unique_ptr<llvm::TargetMachine> target_machine;
+    if (!succeeded(create_target_machine(options, target_machine), error))
+    {
+        return;
+    }
+    emitter.module->setTargetTriple(target_machine->getTargetTriple().str());
+    emitter.module->setDataLayout(target_machine->createDataLayout());
+
+    if (succeeded(optimize_module(*emitter.module, target_machine.get(), options), error))
+    {
+        succeeded(emit_object_file(*emitter.module, *target_machine, path), error);
+    }
+}
+
+// Splits the functions into contiguous partitions, each emitted on its own thread,
+// then combines the objects. Calls across partitions can't be inlined.
+static bool output_partitioned(AST& ast, const CodegenOptions& options, std::string* error)
+{
+    std::vector<ASTNode*> functions;
+    for (ASTNode* node = ast.node(ast.start); node; node = ast.sibling(node))
+    {
+        assert(node->type == ASTNodeType::FunctionDef);
+        functions.push_back(node);
+    }
+
+    uint32_t partition_count = std::min<uint32_t>(options.codegen_threads, functions.size() / MIN_FUNCTIONS_PER_PARTITION);
+    partition_count = std::max(partition_count, 1u);
+
+    std::vector<std::string> paths;
+    for (uint32_t i = 0; i < partition_count; ++i)
+    {
+        paths.push_back(std::string(options.object_path) + "." + std::to_string(i) + ".o");
+    }
+
+    std::vector<std::string> errors(partition_count);
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < partition_count; ++i)
+    {
+        uint32_t begin = (uint64_t)functions.size() * i / partition_count;
+        uint32_t end = (uint64_t)functions.size() * (i + 1) / partition_count;
+        workers.emplace_back(emit_partition, std::ref(ast), functions.data() + begin, end - begin, std::cref(options), paths[i].c_str(), &errors[i]);
+    }
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    // The first partition to fail is reported
+    for (const std::string& partition_error : errors)
+    {
+        if (!partition_error.empty())
+        {
+            *error = partition_error;
+            break;
+        }
+    }
+
+    // The linker prints its own errors
+    bool combined = error->empty() && combine_objects(paths, options.object_path);
+    for (const std::string& path : paths)
+    {
+        remove(path.c_str());
+    }
+
+    if (!combined && error->empty())
+    {
+        *error = "Couldn't combine the partitions into " + std::string(options.object_path);
+    }
+    return combined;
+}
+
+bool output_ast(AST& ast, const CodegenOptions& options, std::string* error)
+{
+    if (options.object_path && options.codegen_threads > 1)
+    {
+        return output_partitioned(ast, options, error);
+    }
+
+    llvm::LLVMContext llvm_ctxt;
+    CodeEmitter emitter(ast, llvm_ctxt);
+    generate_module(emitter, ast);
+
+    if (!verify_module(*emitter.module, error))
+    {
+        return false;
+    }
+
+    std::unique_ptr<llvm::TargetMachine> target_machine;
+    if (!succeeded(create_target_machine(options, target_machine), error))
+    {
+        return false;
+    }
+    if (target_machine)
+    {
+        emitter.module->setTargetTriple(target_machine->getTargetTriple().str());
+        emitter.module->setDataLayout(target_machine->createDataLayout());
+    }
+
+    if (!succeeded(optimize_module(*emitter.module, target_machine.get(), options), error))
+    {
+        return false;
+    }
+
+    if (options.object_path)
+    {
+        return succeeded(emit_object_file(*emitter.module, *target_machine, options.object_path), error);
+    }
 
     emitter.module->print(llvm::errs(), nullptr);
+    return true;
+}
+
+// JIT compiles the module into jit and looks up the function calling main.
+// The context is only handed over along with the module, so if this fails
+// first, it still outlives the module.
+static llvm::Error jit_run_main(CodeEmitter& emitter, std::unique_ptr<llvm::LLVMContext>& llvm_ctxt, const CodegenOptions& options,
+                                std::unique_ptr<llvm::orc::LLJIT>& jit, llvm::JITTargetAddress* run_main_address)
+{
+    llvm::Expected<llvm::orc::JITTargetMachineBuilder> target_builder = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!target_builder) return target_builder.takeError();
+
+    if (options.cpu && strcmp(options.cpu, "native") != 0)
+    {
+        target_builder->setCPU(options.cpu);
+        target_builder->getFeatures() = llvm::SubtargetFeatures();
+    }
+
+    target_builder->setCodeGenOptLevel(codegen_opt_level(options.opt_level));
+
+    llvm::Expected<std::unique_ptr<llvm::TargetMachine>> target_machine = target_builder->createTargetMachine();
+    if (!target_machine) return target_machine.takeError();
+
+    emitter.module->setTargetTriple((*target_machine)->getTargetTriple().str());
+    emitter.module->setDataLayout((*target_machine)->createDataLayout());
+
+    llvm::Error optimized = optimize_module(*emitter.module, target_machine->get(), options);
+    if (optimized) return optimized;
+
+    llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> created_jit = llvm::orc::LLJITBuilder().setJITTargetMachineBuilder(*target_builder).create();
+    if (!created_jit) return created_jit.takeError();
+    jit = std::move(*created_jit);
+
+    // Externals like puts come from this process
+    auto generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix());
+    if (!generator) return generator.takeError();
+    jit->getMainJITDylib().addGenerator(std::move(*generator));
+
+    llvm::Error added = jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(emitter.module), std::move(llvm_ctxt)));
+    if (added) return added;
+
+    llvm::Expected<llvm::JITEvaluatedSymbol> run_main = jit->lookup(RUN_MAIN_NAME);
+    if (!run_main) return run_main.takeError();
+
+    *run_main_address = run_main->getAddress();
+    return llvm::Error::success();
+}
+
+bool run_ast(AST& ast, const CodegenOptions& options, const int64_t* args, uint32_t arg_count, int64_t* result, std::string* error)
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    SymbolData* main_symbol = nullptr;
+    for (ASTNode* node = ast.node(ast.start); node; node = ast.sibling(node))
+    {
+        SymbolData* symbol = static_cast<ASTIdentifierNode*>(node)->symbol;
+        if (node->type == ASTNodeType::FunctionDef && symbol->name == "main" && ast.sibling(ast.child(node)))
+        {
+            main_symbol = symbol;
+        }
+    }
+
+    if (!main_symbol)
+    {
+        *error = "Nothing to run, main isn't defined";
+        return false;
+    }
+
+    uint32_t param_count = type_table_g.get(main_symbol->type_id).param_count;
+    if (arg_count != param_count)
+    {
+        *error = "main takes " + std::to_string(param_count) + " arguments, but " + std::to_string(arg_count) + " were given";
+        return false;
+    }
+
+    // The JIT takes ownership of the context along with the module
+    std::unique_ptr<llvm::LLVMContext> llvm_ctxt(new llvm::LLVMContext);
+    CodeEmitter emitter(ast, *llvm_ctxt);
+    generate_module(emitter, ast);
+    emitter.generate_run_main(main_symbol);
+
+    if (!verify_module(*emitter.module, error))
+    {
+        return false;
+    }
+
+    // Owns the generated code, so it has to outlive the call
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    llvm::JITTargetAddress run_main_address = 0;
+    if (llvm::Error jit_error = jit_run_main(emitter, llvm_ctxt, options, jit, &run_main_address))
+    {
+        *error = "JIT: " + llvm::toString(std::move(jit_error));
+        return false;
+    }
+
+    int64_t (*run_main_ptr)(const int64_t*) = (int64_t (*)(const int64_t*))run_main_address;
+    *result = run_main_ptr(args);
+    return true;
 }
@@ -1,5 +0,0 @@
-#pragma once
-
-struct PhiNode;
-
-typedef PhiNode* SymbolData_Codegen;
@@ -0,0 +1,883 @@
+#include "codegen.h"
+
+#include <elf.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// A backend for debug builds which writes an x86-64 ELF object straight from
+// the AST, without going through LLVM. Every variable and temporary lives in a
+// stack slot, and expressions are evaluated into rax. Values are kept
+// extended to 64 bits, zero or sign extended by their type, so that
+// comparisons can always work on whole registers.
+
+namespace Reg
+{
+    enum
+    {
+        RAX = 0,
+        RCX = 1,
+        RDX = 2,
+        RSP = 4,
+        RBP = 5,
+        RSI = 6,
+        RDI = 7,
+        R8 = 8,
+        R9 = 9,
+    };
+}
+
+// System V argument registers. Any more arguments go on the stack.
+static const uint8_t ARG_REGS[] = {Reg::RDI, Reg::RSI, Reg::RDX, Reg::RCX, Reg::R8, Reg::R9};
+constexpr uint32_t REGISTER_ARGS = sizeof(ARG_REGS);
+
+// Symbol table indices of the section symbols, which come first since they're local
+namespace ElfSymbol
+{
+    enum
+    {
+        Null,
+        Text,
+        Rodata,
+
+        FirstGlobal
+    };
+}
+
+struct X64Emitter
+{
+    AST& ast;
+
+    std::vector<uint8_t> text;
+    std::vector<uint8_t> rodata;
+    std::vector<Elf64_Rela> relocations;
+
+    // Functions defined or called, in symbol table order after the section symbols
+    struct FunctionSymbol
+    {
+        SubString name;
+        bool defined;
+        uint32_t offset;
+        uint32_t size;
+    };
+    std::vector<FunctionSymbol> functions;
+    std::unordered_map<uint32_t, uint32_t> function_indices;    // by name id
+
+    // Bytes of stack slots in use, and the most used at once by the current function
+    int32_t frame_used = 0;
+    int32_t frame_max = 0;
+
+    // Offsets of the rel32 of each jump to the current function's epilogue
+    std::vector<uint32_t> return_jumps;
+
+    // Operators and calls being emitted by emit_expr
+    struct ExprFrame
+    {
+        ASTNode* expr;
+        uint32_t stage;         // Operators: 1 once the lhs is started, 2 once the rhs is.
+                                // Calls: 1 once an argument is started.
+        int32_t slot;           // Operators: holds the lhs. Calls: holds the first argument.
+        ASTNode* next_arg;
+        uint32_t arg_count;     // Arguments stored so far
+    };
+    std::vector<ExprFrame> expr_frames;
+
+    X64Emitter(AST& ast_)
+    :ast(ast_)
+    {}
+
+    void emit8(uint8_t byte)
+    {
+        text.push_back(byte);
+    }
+
+    void emit32(uint32_t value)
+    {
+        uint8_t bytes[4];
+        memcpy(bytes, &value, 4);
+        text.insert(text.end(), bytes, bytes + 4);
+    }
+
+    void emit64(uint64_t value)
+    {
+        uint8_t bytes[8];
+        memcpy(bytes, &value, 8);
+        text.insert(text.end(), bytes, bytes + 8);
+    }
+
+    // Emits a rel32 of 0 for patch_jump to fill in later, and returns where it is
+    uint32_t emit_jump_target()
+    {
+        uint32_t at = text.size();
+        emit32(0);
+        return at;
+    }
+
+    // Points the rel32 at offset to the current position
+    void patch_jump(uint32_t at)
+    {
+        uint32_t rel = text.size() - (at + 4);
+        memcpy(&text[at], &rel, 4);
+    }
+
+    void emit_jump_back(uint32_t target)
+    {
+        emit8(0xE9);    // jmp rel32
+        emit32(target - (text.size() + 4));
+    }
+
+    // op reg, [rbp + offset] with a 32 bit displacement, for any 64 bit register
+    void emit_rbp_access(uint8_t opcode, uint8_t reg, int32_t offset)
+    {
+        emit8(0x48 | (reg >> 3 << 2));  // REX.W, plus REX.R for r8 and up
+        emit8(opcode);
+        emit8(0x85 | (reg & 7) << 3);
+        emit32(offset);
+    }
+
+    void emit_load(uint8_t reg, int32_t offset)
+    {
+        emit_rbp_access(0x8B, reg, offset);     // mov reg, [rbp + offset]
+    }
+
+    void emit_store(uint8_t reg, int32_t offset)
+    {
+        emit_rbp_access(0x89, reg, offset);     // mov [rbp + offset], reg
+    }
+
+    void emit_mov_imm(int64_t value)
+    {
+        if (value == (int32_t)value)
+        {
+            // mov rax, imm32 (sign extended)
+            emit8(0x48);
+            emit8(0xC7);
+            emit8(0xC0);
+            emit32(value);
+        }
+        else
+        {
+            // movabs rax, imm64
+            emit8(0x48);
+            emit8(0xB8);
+            emit64(value);
+        }
+    }
+
+    // Re-extends rax after arithmetic, so it holds a valid value of the type
+    void emit_normalize(uint32_t type_id)
+    {
+        switch (type_id)
+        {
+            case TypeId::U8:
+                emit8(0x0F); emit8(0xB6); emit8(0xC0);                  // movzx eax, al
+                break;
+            case TypeId::I8:
+                emit8(0x48); emit8(0x0F); emit8(0xBE); emit8(0xC0);     // movsx rax, al
+                break;
+            case TypeId::U16:
+                emit8(0x0F); emit8(0xB7); emit8(0xC0);                  // movzx eax, ax
+                break;
+            case TypeId::I16:
+                emit8(0x48); emit8(0x0F); emit8(0xBF); emit8(0xC0);     // movsx rax, ax
+                break;
+            case TypeId::U32:
+                emit8(0x89); emit8(0xC0);                               // mov eax, eax
+                break;
+            case TypeId::I32:
+                emit8(0x48); emit8(0x63); emit8(0xC0);                  // movsxd rax, eax
+                break;
+            case TypeId::Bool:
+                emit8(0x83); emit8(0xE0); emit8(0x01);                  // and eax, 1
+                break;
+            default:
+                break;
+        }
+    }
+
+    int32_t alloc_slot()
+    {
+        frame_used += 8;
+        if (frame_used > frame_max)
+        {
+            frame_max = frame_used;
+        }
+        return -frame_used;
+    }
+
+    // Temporaries are freed in the reverse order they were allocated
+    void free_slot()
+    {
+        frame_used -= 8;
+    }
+
+    uint32_t function_index(const SymbolData* symbol)
+    {
+        auto inserted = function_indices.insert({symbol->name_id, (uint32_t)functions.size()});
+        if (inserted.second)
+        {
+            FunctionSymbol function = {};
+            function.name = symbol->name;
+            functions.push_back(function);
+        }
+        return inserted.first->second;
+    }
+
+    void add_relocation(uint32_t symbol, uint32_t type, int64_t addend)
+    {
+        Elf64_Rela relocation;
+        relocation.r_offset = text.size();
+        relocation.r_info = ELF64_R_INFO(symbol, type);
+        relocation.r_addend = addend;
+        relocations.push_back(relocation);
+    }
+
+    // Emits a leaf into rax, or opens a frame for an operator or call
+    void begin_expr(ASTNode* expr)
+    {
+        switch (expr->type)
+        {
+            case ASTNodeType::Number: {
+                ASTNumberNode* number = static_cast<ASTNumberNode*>(expr);
+                emit_mov_imm(extended_number(number));
+            } break;
+            case ASTNodeType::Identifier:
+                emit_load(Reg::RAX, static_cast<ASTIdentifierNode*>(expr)->symbol->codegen_data.frame_offset);
+                break;
+            case ASTNodeType::String: {
+                ASTStringNode* string = static_cast<ASTStringNode*>(expr);
+
+                uint32_t string_offset = rodata.size();
+                rodata.insert(rodata.end(), string->str.start, string->str.start + string->str.len);
+                rodata.push_back(0);
+
+                // lea rax, [rip + string]
+                emit8(0x48);
+                emit8(0x8D);
+                emit8(0x05);
+                add_relocation(ElfSymbol::Rodata, R_X86_64_PC32, (int64_t)string_offset - 4);
+                emit32(0);
+            } break;
+            case ASTNodeType::BinaryOperator: {
+                ExprFrame frame = {};
+                frame.expr = expr;
+                expr_frames.push_back(frame);
+            } break;
+            case ASTNodeType::FunctionCall: {
+                ExprFrame frame = {};
+                frame.expr = expr;
+                frame.next_arg = ast.sibling(ast.child(expr));
+                expr_frames.push_back(frame);
+            } break;
+            default:
+                assert(false && "Invalid syntax tree - expected a subexpression");
+        }
+    }
+
+    // Leaves the value of the expression in rax. Expressions can be nested
+    // arbitrarily deep, so this keeps an explicit stack instead of recursing.
+    void emit_expr(ASTNode* expr)
+    {
+        expr_frames.clear();
+
+        begin_expr(expr);
+        while (!expr_frames.empty())
+        {
+            ExprFrame& frame = expr_frames.back();
+            if (frame.expr->type == ASTNodeType::BinaryOperator)
+            {
+                ASTBinOpNode* binop = static_cast<ASTBinOpNode*>(frame.expr);
+                ASTNode* lhs = ast.child(binop);
+                ASTNode* rhs = ast.sibling(lhs);
+
+                if (frame.stage == 0)
+                {
+                    frame.stage = 1;
+                    begin_expr(lhs);
+                    continue;
+                }
+
+                if (frame.stage == 1)
+                {
+                    // The lhs is in rax. Numbers and variables can be used in place,
+                    // anything else is evaluated while the lhs waits in a slot.
+                    if (emit_binop_in_place(binop, rhs))
+                    {
+                        emit_binop_result(binop);
+                        expr_frames.pop_back();
+                        continue;
+                    }
+
+                    frame.stage = 2;
+                    frame.slot = alloc_slot();
+                    emit_store(Reg::RAX, frame.slot);
+                    begin_expr(rhs);
+                    continue;
+                }
+
+                // mov rcx, rax
+                emit8(0x48);
+                emit8(0x89);
+                emit8(0xC1);
+
+                emit_load(Reg::RAX, frame.slot);
+                free_slot();
+
+                if (binop->op == '*')
+                {
+                    emit8(0x48);
+                    emit8(0x0F);
+                    emit8(0xAF);
+                    emit8(0xC1);    // imul rax, rcx
+                }
+                else
+                {
+                    emit8(0x48);
+                    emit8(binop_opcode(binop));
+                    emit8(0xC1);    // op rax, rcx
+                }
+
+                emit_binop_result(binop);
+                expr_frames.pop_back();
+                continue;
+            }
+
+            // Evaluate every argument before loading any, since they can contain calls
+            if (frame.stage == 1)
+            {
+                // The last argument is in rax
+                int32_t slot = alloc_slot();
+                if (frame.arg_count == 0)
+                {
+                    frame.slot = slot;
+                }
+                emit_store(Reg::RAX, slot);
+
+                ++frame.arg_count;
+            }
+
+            if (frame.next_arg)
+            {
+                ASTNode* arg = frame.next_arg;
+                frame.next_arg = ast.sibling(arg);
+                frame.stage = 1;
+                begin_expr(arg);
+                continue;
+            }
+
+            // Arguments past the registers go on the stack in order, which has
+            // to stay 16 byte aligned for the call
+            uint32_t stack_bytes = 0;
+            if (frame.arg_count > REGISTER_ARGS)
+            {
+                stack_bytes = ((frame.arg_count - REGISTER_ARGS) * 8 + 15) & ~15;
+
+                // sub rsp, imm32
+                emit8(0x48);
+                emit8(0x81);
+                emit8(0xEC);
+                emit32(stack_bytes);
+
+                for (uint32_t i = REGISTER_ARGS; i < frame.arg_count; ++i)
+                {
+                    emit_load(Reg::RAX, frame.slot - 8 * i);
+
+                    // mov [rsp + disp32], rax
+                    emit8(0x48);
+                    emit8(0x89);
+                    emit8(0x84);
+                    emit8(0x24);
+                    emit32(8 * (i - REGISTER_ARGS));
+                }
+            }
+
+            for (uint32_t i = 0; i < frame.arg_count; ++i)
+            {
+                if (i < REGISTER_ARGS)
+                {
+                    emit_load(ARG_REGS[i], frame.slot - 8 * i);
+                }
+                free_slot();
+            }
+
+            SymbolData* function = static_cast<ASTIdentifierNode*>(ast.child(frame.expr))->symbol;
+
+            // call rel32, through the PLT if it's external
+            emit8(0xE8);
+            add_relocation(ElfSymbol::FirstGlobal + function_index(function), R_X86_64_PLT32, -4);
+            emit32(0);
+
+            if (stack_bytes)
+            {
+                // add rsp, imm32
+                emit8(0x48);
+                emit8(0x81);
+                emit8(0xC4);
+                emit32(stack_bytes);
+            }
+
+            // Only the low bits of the result are defined
+            emit_normalize(type_table_g.get(function->type_id).base);
+
+            expr_frames.pop_back();
+        }
+    }
+
+    // A number's value extended to 64 bits by its type
+    static int64_t extended_number(const ASTNumberNode* number)
+    {
+        uint32_t bits = type_bits(number->type_id);
+        uint64_t value = number->value;
+        if (bits < 64)
+        {
+            uint64_t mask = (1ull << bits) - 1;
+            value &= mask;
+            if (is_signed_integer(number->type_id) && (value >> (bits - 1)))
+            {
+                value |= ~mask;
+            }
+        }
+        return value;
+    }
+
+    // Opcode for op rax, r/m64, besides multiplication
+    static uint8_t binop_opcode(const ASTBinOpNode* binop)
+    {
+        switch (binop->op)
+        {
+            case '+':
+                return 0x03;
+            case '-':
+                return 0x2B;
+            case '<':
+            case '>':
+                return 0x3B;
+            default:
+                assert(false && "Unsupported operator");
+                return 0;
+        }
+    }
+
+    // Applies the operator to rax and an rhs which is a number fitting in an imm32,
+    // or a variable. Returns false without emitting anything for any other rhs.
+    bool emit_binop_in_place(const ASTBinOpNode* binop, ASTNode* rhs)
+    {
+        if (rhs->type == ASTNodeType::Number)
+        {
+            // Operands are already extended, so the immediate only has to fit sign extended
+            int64_t imm = extended_number(static_cast<ASTNumberNode*>(rhs));
+            if (imm != (int32_t)imm)
+            {
+                return false;
+            }
+
+            if (binop->op == '*')
+            {
+                // imul rax, rax, imm32
+                emit8(0x48);
+                emit8(0x69);
+                emit8(0xC0);
+            }
+            else
+            {
+                // The 0x81 /digit form
+                uint8_t imm_digit = binop->op == '+' ? 0 : binop->op == '-' ? 5 : 7;
+                emit8(0x48);
+                emit8(0x81);
+                emit8(0xC0 | imm_digit << 3);
+            }
+            emit32(imm);
+            return true;
+        }
+
+        if (rhs->type == ASTNodeType::Identifier)
+        {
+            int32_t offset = static_cast<ASTIdentifierNode*>(rhs)->symbol->codegen_data.frame_offset;
+            if (binop->op == '*')
+            {
+                // imul rax, [rbp + offset]
+                emit8(0x48);
+                emit8(0x0F);
+                emit8(0xAF);
+                emit8(0x85);
+                emit32(offset);
+            }
+            else
+            {
+                emit_rbp_access(binop_opcode(binop), Reg::RAX, offset);
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+    // Turns the flags from a comparison into a bool, or re-extends arithmetic
+    void emit_binop_result(const ASTBinOpNode* binop)
+    {
+        if (binop->op == '<' || binop->op == '>')
+        {
+            uint8_t setcc;
+            if (binop->op == '<')
+            {
+                setcc = binop->is_signed ? 0x9C : 0x92;     // setl, setb
+            }
+            else
+            {
+                setcc = binop->is_signed ? 0x9F : 0x97;     // setg, seta
+            }
+
+            emit8(0x0F);
+            emit8(setcc);
+            emit8(0xC0);
+
+            // movzx eax, al
+            emit8(0x0F);
+            emit8(0xB6);
+            emit8(0xC0);
+        }
+        else
+        {
+            emit_normalize(binop->type_id);
+        }
+    }
+
+    void emit_statement_list(ASTNode* statement_list)
+    {
+        assert(statement_list->type == ASTNodeType::StatementList);
+
+        for (ASTNode* statement = ast.child(statement_list); statement; statement = ast.sibling(statement))
+        {
+            emit_statement(statement);
+        }
+    }
+
+    // Tests rax, and jumps if it is zero. Returns the jump's rel32 to patch.
+    uint32_t emit_jump_if_zero()
+    {
+        // test rax, rax
+        emit8(0x48);
+        emit8(0x85);
+        emit8(0xC0);
+
+        // jz rel32
+        emit8(0x0F);
+        emit8(0x84);
+        return emit_jump_target();
+    }
+
+    void emit_statement(ASTNode* statement)
+    {
+        switch (statement->type)
+        {
+            case ASTNodeType::VariableDef: {
+                SymbolData* symbol = static_cast<ASTIdentifierNode*>(statement)->symbol;
+                emit_expr(ast.child(statement));
+
+                // Allocated after evaluating, so the expression's temporaries can reuse the space
+                symbol->codegen_data.frame_offset = alloc_slot();
+                emit_store(Reg::RAX, symbol->codegen_data.frame_offset);
+            } break;
+            case ASTNodeType::Assignment: {
+                SymbolData* symbol = static_cast<ASTIdentifierNode*>(statement)->symbol;
+                emit_expr(ast.child(statement));
+                emit_store(Reg::RAX, symbol->codegen_data.frame_offset);
+            } break;
+            case ASTNodeType::FunctionDef:
+                // do nothing
+                break;
+            case ASTNodeType::Return:
+                if (ast.child(statement))
+                {
+                    emit_expr(ast.child(statement));
+                }
+                emit8(0xE9);    // jmp rel32
+                return_jumps.push_back(emit_jump_target());
+                break;
+            case ASTNodeType::If: {
+                ASTNode* then_list = ast.sibling(ast.child(statement));
+                ASTNode* else_list = ast.sibling(then_list);
+
+                emit_expr(ast.child(statement));
+                uint32_t to_else = emit_jump_if_zero();
+
+                emit_statement_list(then_list);
+
+                if (else_list)
+                {
+                    emit8(0xE9);
+                    uint32_t to_end = emit_jump_target();
+
+                    patch_jump(to_else);
+                    emit_statement_list(else_list);
+                    patch_jump(to_end);
+                }
+                else
+                {
+                    patch_jump(to_else);
+                }
+            } break;
+            case ASTNodeType::While: {
+                uint32_t loop_start = text.size();
+
+                emit_expr(ast.child(statement));
+                uint32_t to_end = emit_jump_if_zero();
+
+                emit_statement_list(ast.sibling(ast.child(statement)));
+                emit_jump_back(loop_start);
+
+                patch_jump(to_end);
+            } break;
+            default:
+                // An expression statement, the value is unused
+                emit_expr(statement);
+        }
+    }
+
+    void generate_function_def(ASTNode* function_def)
+    {
+        ASTNode* parameter_list = ast.child(function_def);
+        ASTNode* statement_list = ast.sibling(parameter_list);
+
+        // Declarations only get a symbol if they're called
+        if (!statement_list)
+        {
+            return;
+        }
+
+        uint32_t index = function_index(static_cast<ASTIdentifierNode*>(function_def)->symbol);
+        assert(!functions[index].defined && "Function defined twice");
+        functions[index].defined = true;
+        functions[index].offset = text.size();
+
+        frame_used = 0;
+        frame_max = 0;
+        return_jumps.clear();
+
+        // push rbp; mov rbp, rsp; sub rsp, imm32
+        emit8(0x55);
+        emit8(0x48);
+        emit8(0x89);
+        emit8(0xE5);
+        emit8(0x48);
+        emit8(0x81);
+        emit8(0xEC);
+        uint32_t frame_size_at = text.size();
+        emit32(0);
+
+        // Parameters are spilled to slots, extended since callers only set the low bits
+        uint32_t param_index = 0;
+        for (ASTNode* param = ast.child(parameter_list); param; param = ast.sibling(param), ++param_index)
+        {
+            SymbolData* symbol = static_cast<ASTIdentifierNode*>(param)->symbol;
+
+            if (param_index < REGISTER_ARGS)
+            {
+                uint8_t reg = ARG_REGS[param_index];
+
+                // mov rax, reg
+                emit8(0x48 | (reg >> 3 << 2));
+                emit8(0x89);
+                emit8(0xC0 | (reg & 7) << 3);
+            }
+            else
+            {
+                // The rest are above the return address and the saved rbp
+                emit_load(Reg::RAX, 16 + 8 * (param_index - REGISTER_ARGS));
+            }
+            emit_normalize(symbol->type_id);
+
+            symbol->codegen_data.frame_offset = alloc_slot();
+            emit_store(Reg::RAX, symbol->codegen_data.frame_offset);
+        }
+
+        emit_statement_list(statement_list);
+
+        // Running off the end gives 0, like the other backends. Returns jump past this.
+        // xor eax, eax
+        emit8(0x31);
+        emit8(0xC0);
+
+        for (uint32_t at : return_jumps)
+        {
+            patch_jump(at);
+        }
+
+        // leave; ret
+        emit8(0xC9);
+        emit8(0xC3);
+
+        // Keep rsp 16 byte aligned for calls
+        uint32_t frame_size = (frame_max + 15) & ~15;
+        memcpy(&text[frame_size_at], &frame_size, 4);
+
+        functions[index].size = text.size() - functions[index].offset;
+    }
+};
+
+namespace ElfSection
+{
+    enum
+    {
+        Null,
+        Text,
+        Rodata,
+        RelaText,
+        Symtab,
+        Strtab,
+        Shstrtab,
+        NoteStack,
+
+        Count
+    };
+}
+
+static uint64_t align_to(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Appends a null terminated name, returning its offset
+static uint32_t add_name(std::vector<char>& table, const char* name, uint32_t len)
+{
+    uint32_t offset = table.size();
+    table.insert(table.end(), name, name + len);
+    table.push_back(0);
+    return offset;
+}
+
+static bool write_elf_object(const X64Emitter& emitter, const char* path, std::string* error)
+{
+    std::vector<char> strtab(1, 0);
+    std::vector<Elf64_Sym> symbols(ElfSymbol::FirstGlobal);
+    memset(symbols.data(), 0, sizeof(Elf64_Sym) * symbols.size());
+
+    symbols[ElfSymbol::Text].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    symbols[ElfSymbol::Text].st_shndx = ElfSection::Text;
+    symbols[ElfSymbol::Rodata].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    symbols[ElfSymbol::Rodata].st_shndx = ElfSection::Rodata;
+
+    for (const X64Emitter::FunctionSymbol& function : emitter.functions)
+    {
+        Elf64_Sym symbol = {};
+        symbol.st_name = add_name(strtab, function.name.start, function.name.len);
+        if (function.defined)
+        {
+            symbol.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+            symbol.st_shndx = ElfSection::Text;
+            symbol.st_value = function.offset;
+            symbol.st_size = function.size;
+        }
+        else
+        {
+            symbol.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+            symbol.st_shndx = SHN_UNDEF;
+        }
+        symbols.push_back(symbol);
+    }
+
+    std::vector<char> shstrtab(1, 0);
+    Elf64_Shdr sections[ElfSection::Count] = {};
+
+    const char* names[ElfSection::Count] = {"", ".text", ".rodata", ".rela.text", ".symtab", ".strtab", ".shstrtab", ".note.GNU-stack"};
+    for (uint32_t i = 1; i < ElfSection::Count; ++i)
+    {
+        sections[i].sh_name = add_name(shstrtab, names[i], strlen(names[i]));
+    }
+
+    // Lay the sections out after the header, in order
+    const void* contents[ElfSection::Count] = {};
+    uint64_t offset = sizeof(Elf64_Ehdr);
+    auto place = [&](uint32_t index, uint32_t type, uint64_t flags, const void* data, uint64_t size, uint64_t align)
+    {
+        offset = align_to(offset, align);
+        sections[index].sh_type = type;
+        sections[index].sh_flags = flags;
+        sections[index].sh_offset = offset;
+        sections[index].sh_size = size;
+        sections[index].sh_addralign = align;
+        contents[index] = data;
+        offset += size;
+    };
+
+    place(ElfSection::Text, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, emitter.text.data(), emitter.text.size(), 16);
+    place(ElfSection::Rodata, SHT_PROGBITS, SHF_ALLOC, emitter.rodata.data(), emitter.rodata.size(), 1);
+
+    place(ElfSection::RelaText, SHT_RELA, SHF_INFO_LINK, emitter.relocations.data(), emitter.relocations.size() * sizeof(Elf64_Rela), 8);
+    sections[ElfSection::RelaText].sh_link = ElfSection::Symtab;
+    sections[ElfSection::RelaText].sh_info = ElfSection::Text;
+    sections[ElfSection::RelaText].sh_entsize = sizeof(Elf64_Rela);
+
+    place(ElfSection::Symtab, SHT_SYMTAB, 0, symbols.data(), symbols.size() * sizeof(Elf64_Sym), 8);
+    sections[ElfSection::Symtab].sh_link = ElfSection::Strtab;
+    sections[ElfSection::Symtab].sh_info = ElfSymbol::FirstGlobal;
+    sections[ElfSection::Symtab].sh_entsize = sizeof(Elf64_Sym);
+
+    place(ElfSection::Strtab, SHT_STRTAB, 0, strtab.data(), strtab.size(), 1);
+    place(ElfSection::Shstrtab, SHT_STRTAB, 0, shstrtab.data(), shstrtab.size(), 1);
+
+    // Marks the stack as not executable
+    place(ElfSection::NoteStack, SHT_PROGBITS, 0, nullptr, 0, 1);
+
+    uint64_t section_headers_offset = align_to(offset, 8);
+
+    Elf64_Ehdr header = {};
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_REL;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_shoff = section_headers_offset;
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_shentsize = sizeof(Elf64_Shdr);
+    header.e_shnum = ElfSection::Count;
+    header.e_shstrndx = ElfSection::Shstrtab;
+
+    // Build the whole file in memory, so it's written in one go
+    std::vector<uint8_t> file(section_headers_offset + sizeof(sections), 0);
+    memcpy(file.data(), &header, sizeof(header));
+    for (uint32_t i = 1; i < ElfSection::Count; ++i)
+    {
+        if (sections[i].sh_size)
+        {
+            memcpy(file.data() + sections[i].sh_offset, contents[i], sections[i].sh_size);
+        }
+    }
+    memcpy(file.data() + section_headers_offset, sections, sizeof(sections));
+
+    FILE* out = fopen(path, "wb");
+    bool written = out && fwrite(file.data(), 1, file.size(), out) == file.size();
+    if (out && fclose(out) != 0)
+    {
+        written = false;
+    }
+
+    if (!written)
+    {
+        *error = "Couldn't write " + std::string(path);
+        return false;
+    }
+    return true;
+}
+
+bool output_ast_x64(AST& ast, const CodegenOptions& options, std::string* error)
+{
+    assert(options.object_path && "The x86-64 backend only writes object files");
+
+    X64Emitter emitter(ast);
+
+    for (ASTNode* node = ast.node(ast.start); node; node = ast.sibling(node))
+    {
+        assert(node->type == ASTNodeType::FunctionDef);
+        emitter.generate_function_def(node);
+    }
+
+    return write_elf_object(emitter, options.object_path, error);
+}
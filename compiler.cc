@@ -1,48 +1,373 @@
-#include <fstream>
-#include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
 
 #include "report_error.h"
 
 #include <iostream>
+#include <chrono>
+#include <thread>
 
+#include "source_file.h"
 #include "lexer.h"
 #include "parser.h"
 #include "type_check.h"
 #include "codegen.h"
+#include "ast_cache.h"
+#include "constant_fold.h"
+#include "link.h"
+
+namespace Backend
+{
+    enum
+    {
+        LLVM,
+        X64,
+        Interpreter,
+    };
+}
 
 int main(int argc, char **argv)
 {
-    assert(argc == 2);
+    // Usage: compiler [--arena-stats] [--time] [--lazy] [--stream] [--cache-dir dir]
+    //                 [-O0..-O3] [--passes pipeline] [--time-passes]
+    //                 [--target triple] [-march=cpu|native] [--codegen-threads n]
+    //                 [--backend llvm|x64|interp] [-c] [-o output] file
+    //        compiler [options] --run file [args]
+    // With -o an executable is written, or just an object file with -c.
+    // Files big enough to lex in parallel are lexed up front, and their function bodies
+    // parsed in parallel. --stream always lexes as the parser goes instead, which is
+    // slower for those files but only keeps a window of tokens in memory.
+    // --codegen-threads splits codegen for -o across threads, 0 meaning one per core.
+    // --run JIT compiles the file and calls main with the integer args that follow it,
+    // exiting with main's result. Otherwise IR is printed to stderr.
+    // --backend x64 writes x86-64 code directly instead of going through LLVM, which
+    // is much faster but unoptimized, and needs -o. --backend interp runs the file
+    // with --run through a bytecode interpreter instead of the JIT.
+    bool print_arena_stats = false;
+    bool lazy = false;
+    bool stream = false;
+    bool print_times = false;
+    const char* cache_dir = nullptr;
+    const char* path = nullptr;
+    const char* output_path = nullptr;
+    bool object_only = false;
+    bool run = false;
+    uint32_t backend = Backend::LLVM;
+    std::vector<int64_t> run_args;
+    CodegenOptions codegen_options;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--arena-stats") == 0)
+        {
+            print_arena_stats = true;
+        }
+        else if (strcmp(argv[i], "--time") == 0)
+        {
+            print_times = true;
+        }
+        else if (strcmp(argv[i], "--lazy") == 0)
+        {
+            lazy = true;
+        }
+        else if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream = true;
+        }
+        else if (strcmp(argv[i], "--cache-dir") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Expected a directory after --cache-dir\n");
+                return 1;
+            }
+            cache_dir = argv[++i];
+        }
+        else if (strncmp(argv[i], "-O", 2) == 0)
+        {
+            if (argv[i][2] < '0' || argv[i][2] > '3' || argv[i][3])
+            {
+                fprintf(stderr, "Optimization level must be -O0 to -O3, not %s\n", argv[i]);
+                return 1;
+            }
+            codegen_options.opt_level = argv[i][2] - '0';
+        }
+        else if (strcmp(argv[i], "--passes") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Expected a pass pipeline after --passes\n");
+                return 1;
+            }
+            codegen_options.passes = argv[++i];
+        }
+        else if (strcmp(argv[i], "--time-passes") == 0)
+        {
+            codegen_options.time_passes = true;
+        }
+        else if (strcmp(argv[i], "--target") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Expected a target triple after --target\n");
+                return 1;
+            }
+            codegen_options.target_triple = argv[++i];
+        }
+        else if (strncmp(argv[i], "-march=", 7) == 0)
+        {
+            codegen_options.cpu = argv[i] + 7;
+        }
+        else if (strcmp(argv[i], "--codegen-threads") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Expected a thread count after --codegen-threads\n");
+                return 1;
+            }
+            char* end;
+            long threads = strtol(argv[++i], &end, 10);
+            if (*end || end == argv[i] || threads < 0)
+            {
+                fprintf(stderr, "Thread count must be a number, not %s\n", argv[i]);
+                return 1;
+            }
 
-    // read in file
-    std::ifstream file(argv[1], std::ios_base::in | std::ios_base::ate);
-    size_t len = file.tellg();
+            codegen_options.codegen_threads = threads;
+            if (codegen_options.codegen_threads == 0)
+            {
+                codegen_options.codegen_threads = std::thread::hardware_concurrency();
+            }
+        }
+        else if (strcmp(argv[i], "--run") == 0)
+        {
+            run = true;
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            object_only = true;
+        }
+        else if (strcmp(argv[i], "--backend") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Expected llvm, x64 or interp after --backend\n");
+                return 1;
+            }
+            ++i;
+            if (strcmp(argv[i], "llvm") == 0)
+            {
+                backend = Backend::LLVM;
+            }
+            else if (strcmp(argv[i], "x64") == 0)
+            {
+                backend = Backend::X64;
+            }
+            else if (strcmp(argv[i], "interp") == 0)
+            {
+                backend = Backend::Interpreter;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown backend %s, expected llvm, x64 or interp\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "Expected a file after -o\n");
+                return 1;
+            }
+            output_path = argv[++i];
+        }
+        else if (run && path)
+        {
+            // Everything after the file is for main
+            char* end;
+            run_args.push_back(strtoll(argv[i], &end, 0));
+            if (*end || end == argv[i])
+            {
+                fprintf(stderr, "Arguments to main must be integers, not %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            if (path)
+            {
+                fprintf(stderr, "Only one input file is supported\n");
+                return 1;
+            }
+            path = argv[i];
+        }
+    }
 
-    file.seekg(std::ios_base::beg);
-    
-    char *file_contents = new char[len + 1];
-    file_contents[len] = 0;
+    // Combinations of options which don't make sense
+    const char* usage_error = nullptr;
+    if (!path) usage_error = "No input file";
+    else if (object_only && !output_path) usage_error = "-c needs an output file";
+    else if (run && output_path) usage_error = "--run doesn't write any output";
+    else if (stream && lazy) usage_error = "--lazy needs every token up front, so it can't stream";
+    else if (backend == Backend::X64 && !output_path) usage_error = "The x64 backend needs an output file";
+    else if (backend == Backend::Interpreter && !run) usage_error = "The interpreter only works with --run";
 
-    file.read(file_contents, len);
+    if (usage_error)
+    {
+        fprintf(stderr, "%s\n", usage_error);
+        return 1;
+    }
 
-    init_error_reporting(file_contents);
+    // When linking, the object file is only needed until the executable is written
+    std::string object_path;
+    if (output_path)
+    {
+        object_path = object_only ? output_path : std::string(output_path) + ".o";
+        codegen_options.object_path = object_path.c_str();
+    }
 
-    // get tokens
-    std::vector<Token> tokens;
-    lex(file_contents, tokens);
+    // read in file, "-" reads from stdin
+    SourceFile source_file;
+    load_source_file(path, source_file);
+
+    auto front_end_start = std::chrono::steady_clock::now();
 
-    // generate AST
     AST ast;
 
-    Scope global_scope;
-    global_scope.symbols.max_length = MAX_SYMBOLS;
-    global_scope.symbols.data = new SymbolData[MAX_SYMBOLS];
+    // A cache hit gives us a type checked AST without looking at the tokens at all
+    bool cache_hit = cache_dir && load_cached_ast(cache_dir, source_file, lazy, ast);
+    if (!cache_hit)
+    {
+        Scope global_scope;
+        global_scope.init(ast.arena, nullptr);
+
+        if (lazy)
+        {
+            // Only functions reachable from main are parsed, type checked and generated
+            TokenStream tokens;
+            lex(source_file, tokens);
+
+            LazyParser lazy_parser;
+            lazy_parser.init(tokens, ast, global_scope);
+            lazy_parser.reach_roots(global_scope);
+
+            while (ASTNode* function_def = lazy_parser.parse_next())
+            {
+                set_function_type_info(ast, function_def);
+            }
+
+            lazy_parser.remove_unreached();
+            if (print_arena_stats) ast.arena.print_stats("parse and type check");
+
+            fold_constants(ast);
+        }
+        else
+        {
+            if (!stream && lexes_in_parallel(source_file))
+            {
+                // Big enough to lex in parallel, which needs all the tokens in memory.
+                // Function bodies can then be parsed in parallel too.
+                TokenStream tokens;
+                lex(source_file, tokens);
+                parse(tokens, ast, global_scope);
+            }
+            else
+            {
+                // generate AST, lexing as we go, so only a window of tokens is kept
+                parse(source_file, ast, global_scope);
+            }
+            if (print_arena_stats)
+            {
+                ast.arena.print_stats("parse");
+                std::cout << "ast nodes: " << ast.node_bytes() << " bytes" << std::endl;
+            }
+
+            set_ast_type_info(ast);
+            if (print_arena_stats) ast.arena.print_stats("type check");
+
+            fold_constants(ast);
+        }
+
+        if (cache_dir) save_cached_ast(cache_dir, source_file, lazy, ast);
+    }
+
+    if (print_times)
+    {
+        std::chrono::duration<double, std::milli> front_end_time = std::chrono::steady_clock::now() - front_end_start;
+        std::cout << "front end: " << front_end_time.count() << " ms"
+                  << (!cache_dir ? "" : cache_hit ? " (cache hit)" : " (cache miss)") << std::endl;
+    }
+
+    if (run)
+    {
+        auto run_start = std::chrono::steady_clock::now();
+
+        int64_t result = 0;
+        std::string error;
+        bool ran = backend == Backend::Interpreter
+            ? interpret_ast(ast, run_args.data(), run_args.size(), &result, &error)
+            : run_ast(ast, codegen_options, run_args.data(), run_args.size(), &result, &error);
+
+        if (!ran)
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            close_source_file(source_file);
+            return 1;
+        }
+
+        if (print_times)
+        {
+            // Includes JIT compiling, or lowering to bytecode
+            std::chrono::duration<double, std::milli> run_time = std::chrono::steady_clock::now() - run_start;
+            std::cout << "run: " << run_time.count() << " ms" << std::endl;
+        }
+        close_source_file(source_file);
+        return (int)result;
+    }
+
+    auto codegen_start = std::chrono::steady_clock::now();
+
+    std::string error;
+    bool output = backend == Backend::X64
+        ? output_ast_x64(ast, codegen_options, &error)
+        : output_ast(ast, codegen_options, &error);
+
+    if (!output)
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        close_source_file(source_file);
+        return 1;
+    }
+    if (print_arena_stats) ast.arena.print_stats("codegen");
+
+    if (print_times)
+    {
+        std::chrono::duration<double, std::milli> codegen_time = std::chrono::steady_clock::now() - codegen_start;
+        std::cout << "codegen: " << codegen_time.count() << " ms" << std::endl;
+    }
+
+    int result = 0;
+    if (output_path && !object_only)
+    {
+        auto link_start = std::chrono::steady_clock::now();
 
-    parse(tokens, ast, global_scope);
+        if (!link_executable(object_path.c_str(), output_path))
+        {
+            result = 1;
+        }
+        remove(object_path.c_str());
 
-    set_ast_type_info(ast);
+        if (print_times)
+        {
+            std::chrono::duration<double, std::milli> link_time = std::chrono::steady_clock::now() - link_start;
+            std::cout << "link: " << link_time.count() << " ms" << std::endl;
+        }
+    }
 
-    output_ast(ast);
+    close_source_file(source_file);
 
-    return 0;
+    return result;
 }
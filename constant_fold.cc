@@ -0,0 +1,147 @@
+#include "constant_fold.h"
+#include "codegen.h"
+
+#include <vector>
+
+static uint64_t truncate(uint64_t value, uint32_t bits)
+{
+    return bits >= 64 ? value : value & ((1ull << bits) - 1);
+}
+
+// Literals can be wider than their type, so compare what codegen would emit
+static bool is_number(ASTNode* node, uint64_t value)
+{
+    if (node->type != ASTNodeType::Number) return false;
+
+    ASTNumberNode* number = static_cast<ASTNumberNode*>(node);
+    return truncate(number->value, type_bits(number->type_id)) == value;
+}
+
+// True if evaluating expr has no side effects, so it can be dropped
+static bool is_pure(AST& ast, ASTNode* expr)
+{
+    // Expressions can be nested arbitrarily deep, so walk them with an explicit stack
+    std::vector<ASTNode*> stack(1, expr);
+    while (!stack.empty())
+    {
+        ASTNode* node = stack.back();
+        stack.pop_back();
+
+        if (node->type == ASTNodeType::FunctionCall) return false;
+
+        for (ASTNode* child = ast.child(node); child; child = ast.sibling(child))
+        {
+            stack.push_back(child);
+        }
+    }
+    return true;
+}
+
+// Returns what to replace the operator with, which may be the operator itself.
+// The operands must already be folded.
+static NodeRef fold_binop(AST& ast, NodeRef ref)
+{
+    ASTBinOpNode* binop = static_cast<ASTBinOpNode*>(ast.node(ref));
+    ASTNode* lhs = ast.child(binop);
+    ASTNode* rhs = ast.sibling(lhs);
+    NodeRef lhs_ref = binop->child;
+    NodeRef rhs_ref = lhs->sibling;
+
+    // Evaluated by the interpreter, so folding can't disagree with running the program
+    int64_t value;
+    if (lhs->type == ASTNodeType::Number && rhs->type == ASTNodeType::Number && evaluate_constant(ast, binop, &value))
+    {
+        ASTNumberNode folded(truncate(value, type_bits(binop->type_id)));
+        folded.type_id = binop->type_id;
+        return ast.push_orphan(folded);
+    }
+
+    switch (binop->op)
+    {
+        case '+':
+            if (is_number(rhs, 0)) return lhs_ref;
+            if (is_number(lhs, 0)) return rhs_ref;
+            break;
+        case '-':
+            if (is_number(rhs, 0)) return lhs_ref;
+            break;
+        case '*':
+            if (is_number(rhs, 1)) return lhs_ref;
+            if (is_number(lhs, 1)) return rhs_ref;
+
+            // The other operand only has to be evaluated if it might have side effects
+            if (is_number(rhs, 0) && is_pure(ast, lhs)) return rhs_ref;
+            if (is_number(lhs, 0) && is_pure(ast, rhs)) return lhs_ref;
+            break;
+    }
+
+    return ref;
+}
+
+struct FoldFrame
+{
+    NodeRef parent;
+    NodeRef prev;       // Last child already folded
+    NodeRef child;      // Next child to fold
+};
+
+// Folds everything under parent, bottom up, and puts the results in place of
+// the children. parent itself is never replaced. Expressions can be nested
+// arbitrarily deep, so this keeps an explicit stack instead of recursing.
+static void fold_children(AST& ast, NodeRef parent)
+{
+    std::vector<FoldFrame> frames;
+
+    FoldFrame top = {parent, NO_NODE, ast.node(parent)->child};
+    frames.push_back(top);
+
+    while (true)
+    {
+        NodeRef child = frames.back().child;
+        if (child != NO_NODE)
+        {
+            // Fold the child's own children first
+            FoldFrame frame = {child, NO_NODE, ast.node(child)->child};
+            frames.push_back(frame);
+            continue;
+        }
+
+        // Every child is done, so the node itself can be folded
+        NodeRef ref = frames.back().parent;
+        frames.pop_back();
+        if (frames.empty())
+        {
+            return;
+        }
+
+        NodeRef next = ast.node(ref)->sibling;
+        NodeRef folded = ref;
+        if (ast.node(ref)->type == ASTNodeType::BinaryOperator)
+        {
+            folded = fold_binop(ast, ref);
+        }
+
+        FoldFrame& frame = frames.back();
+        ast.node(folded)->sibling = next;
+        if (frame.prev == NO_NODE)
+        {
+            ast.node(frame.parent)->child = folded;
+        }
+        else
+        {
+            ast.node(frame.prev)->sibling = folded;
+        }
+
+        frame.prev = folded;
+        frame.child = next;
+    }
+}
+
+void fold_constants(AST& ast)
+{
+    // Top-level definitions are never replaced themselves
+    for (NodeRef ref = ast.start; ref != NO_NODE; ref = ast.node(ref)->sibling)
+    {
+        fold_children(ast, ref);
+    }
+}
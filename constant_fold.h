@@ -0,0 +1,7 @@
+#pragma once
+#include "parser.h"
+
+// Folds constant subexpressions and simplifies x * 1, x + 0 and friends,
+// so less IR reaches LLVM. Needs literal types, so it runs after type checking.
+// Folded values are new nodes, so this isn't thread safe.
+void fold_constants(AST& ast);
@@ -0,0 +1,71 @@
+#include "intern.h"
+
+#include <cstring>
+#include <cassert>
+
+StringInterner interner_g;
+
+StringInterner::StringInterner()
+{
+    // Names are usually small, so a smaller block size is fine
+    pool.block_size = 256 * 1024;
+    table.resize(1024);
+
+    uint32_t empty = intern(SubString());
+    assert(empty == EMPTY);
+    (void)empty;
+}
+
+uint32_t StringInterner::intern(SubString str)
+{
+    uint32_t hash = str.hash();
+
+    uint32_t mask = table.size() - 1;
+    uint32_t slot = hash & mask;
+    for (; table[slot]; slot = (slot + 1) & mask)
+    {
+        uint32_t id = table[slot] - 1;
+        if (hashes[id] == hash && names[id] == str)
+        {
+            return id;
+        }
+    }
+
+    // New name, copy it into the pool with a terminator
+    char* copy = (char*)pool.alloc(str.len + 1, 1);
+    memcpy(copy, str.start, str.len);
+    copy[str.len] = 0;
+
+    SubString pooled;
+    pooled.start = copy;
+    pooled.len = str.len;
+
+    uint32_t id = names.size();
+    names.push_back(pooled);
+    hashes.push_back(hash);
+    table[slot] = id + 1;
+
+    // Keep the load factor at most 1/2
+    if (2 * names.size() > table.size())
+    {
+        grow();
+    }
+
+    return id;
+}
+
+void StringInterner::grow()
+{
+    table.assign(table.size() * 2, 0);
+
+    uint32_t mask = table.size() - 1;
+    for (uint32_t id = 0; id < names.size(); ++id)
+    {
+        uint32_t slot = hashes[id] & mask;
+        while (table[slot])
+        {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = id + 1;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "util.h"
+#include "arena.h"
+#include <vector>
+#include <stdint.h>
+
+// Maps each distinct identifier to a dense id, so names can be compared
+// with a single integer compare. Interned names are copied into one pool,
+// and never move once interned.
+// Not thread safe.
+struct StringInterner
+{
+    // Id of the empty string, interned up front
+    static const uint32_t EMPTY = 0;
+
+    StringInterner();
+
+    uint32_t intern(SubString str);
+
+    SubString get(uint32_t id) const
+    {
+        return names[id];
+    }
+
+    uint32_t size() const
+    {
+        return names.size();
+    }
+
+private:
+    Arena pool;
+    std::vector<SubString> names;
+    std::vector<uint32_t> hashes;
+
+    // Open addressing hash table of id + 1, zero if the entry is empty
+    std::vector<uint32_t> table;
+
+    void grow();
+};
+
+// Identifiers from all source files
+extern StringInterner interner_g;
@@ -0,0 +1,875 @@
+#include "codegen.h"
+
+#include <dlfcn.h>
+
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Runs programs without generating machine code, by lowering the AST into a
+// register based bytecode and interpreting that. Every parameter, variable and
+// temporary of a function gets a register in its frame. Like the x86-64
+// backend, registers hold values zero or sign extended to 64 bits by their type,
+// so comparisons always work on whole registers.
+
+namespace Op
+{
+    enum
+    {
+        LoadConst,      // a = constants[bc]
+        Move,           // a = b
+
+        Add,            // a = b op c
+        Sub,
+        Mul,
+        LessUnsigned,
+        LessSigned,
+        GreaterUnsigned,
+        GreaterSigned,
+
+        // Re-extend a in place after arithmetic
+        ExtendU8,
+        ExtendI8,
+        ExtendU16,
+        ExtendI16,
+        ExtendU32,
+        ExtendI32,
+        ExtendBool,
+
+        Jump,           // to bc
+        JumpIfZero,     // to bc if a is zero
+        Call,           // a = functions[c](b, b + 1, ...)
+        Return,         // returns a
+        ReturnNone,
+
+        Count
+    };
+}
+
+struct Instruction
+{
+    uint16_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+};
+
+// Jump targets and constant indices take up both b and c
+static uint32_t wide_operand(const Instruction* instruction)
+{
+    return instruction->b | (uint32_t)instruction->c << 16;
+}
+
+static void set_wide_operand(Instruction& instruction, uint32_t value)
+{
+    instruction.b = value & 0xFFFF;
+    instruction.c = value >> 16;
+}
+
+// Registers and functions are numbered with 16 bits
+constexpr uint32_t MAX_REGISTERS = 0xFFFF;
+constexpr uint32_t MAX_FUNCTIONS = 0xFFFF;
+
+// Registers for all the frames on the interpreter's call stack
+constexpr uint32_t STACK_REGISTERS = 1024 * 1024;
+
+// Each call recurses in execute too, so this keeps it within the thread's own stack
+constexpr uint32_t MAX_CALL_DEPTH = 32 * 1024;
+
+// C functions like puts are called with up to this many integer arguments
+constexpr uint32_t MAX_EXTERNAL_ARGS = 6;
+
+struct BytecodeFunction
+{
+    SymbolData* symbol;
+    bool defined = false;
+
+    std::vector<Instruction> code;
+    std::vector<int64_t> constants;
+    uint32_t register_count = 0;
+
+    // Looked up in this process for functions without a body, if they're called
+    bool called = false;
+    void* external = nullptr;
+};
+
+static uint32_t extend_op(uint32_t type_id)
+{
+    switch (type_id)
+    {
+        case TypeId::U8:
+            return Op::ExtendU8;
+        case TypeId::I8:
+            return Op::ExtendI8;
+        case TypeId::U16:
+            return Op::ExtendU16;
+        case TypeId::I16:
+            return Op::ExtendI16;
+        case TypeId::U32:
+            return Op::ExtendU32;
+        case TypeId::I32:
+            return Op::ExtendI32;
+        case TypeId::Bool:
+            return Op::ExtendBool;
+        default:
+            return Op::Count;
+    }
+}
+
+// What the extend ops do, for values coming from outside of the bytecode
+static int64_t extend(int64_t value, uint32_t type_id)
+{
+    switch (type_id)
+    {
+        case TypeId::U8:
+            return (uint8_t)value;
+        case TypeId::I8:
+            return (int8_t)value;
+        case TypeId::U16:
+            return (uint16_t)value;
+        case TypeId::I16:
+            return (int16_t)value;
+        case TypeId::U32:
+            return (uint32_t)value;
+        case TypeId::I32:
+            return (int32_t)value;
+        case TypeId::Bool:
+            return value & 1;
+        default:
+            return value;
+    }
+}
+
+struct BytecodeLowering
+{
+    AST& ast;
+
+    std::vector<BytecodeFunction> functions;
+    std::unordered_map<uint32_t, uint32_t> function_indices;    // by name id
+
+    // The function being lowered, and its registers in use
+    BytecodeFunction* function = nullptr;
+    uint32_t registers_used = 0;
+
+    // Set if the module can't be run. Lowering carries on, but the code is unusable.
+    std::string error;
+
+    // Operators and calls being lowered by lower_expr
+    struct ExprFrame
+    {
+        ASTNode* expr;
+        uint16_t dst;
+        bool dst_is_temp;
+
+        // Operators
+        uint32_t operands_started;
+        uint16_t lhs_reg;
+        uint16_t rhs_reg;
+        bool lhs_is_temp;
+        bool rhs_is_temp;
+
+        // Calls
+        ASTNode* next_arg;
+        uint16_t first_arg;
+        uint16_t next_reg;
+        uint32_t arg_count;
+        uint32_t args_allocated;
+    };
+    std::vector<ExprFrame> expr_frames;
+
+    BytecodeLowering(AST& ast_)
+    :ast(ast_)
+    {}
+
+    uint32_t function_index(SymbolData* symbol)
+    {
+        auto inserted = function_indices.insert({symbol->name_id, (uint32_t)functions.size()});
+        if (inserted.second)
+        {
+            assert(functions.size() < MAX_FUNCTIONS && "Too many functions");
+
+            BytecodeFunction new_function;
+            new_function.symbol = symbol;
+            functions.push_back(new_function);
+        }
+        return inserted.first->second;
+    }
+
+    uint16_t alloc_register()
+    {
+        if (registers_used >= MAX_REGISTERS && error.empty())
+        {
+            std::string name = function->symbol
+                             ? "Function " + std::string(function->symbol->name.start, function->symbol->name.len)
+                             : std::string("Constant expression");
+            error = name + " needs more than " + std::to_string(MAX_REGISTERS) + " registers";
+        }
+
+        uint16_t result = registers_used++;
+        if (registers_used > function->register_count)
+        {
+            function->register_count = registers_used;
+        }
+        return result;
+    }
+
+    // Temporaries are freed in the reverse order they were allocated
+    void free_register()
+    {
+        --registers_used;
+    }
+
+    uint32_t emit(uint32_t op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0)
+    {
+        Instruction instruction = {(uint16_t)op, a, b, c};
+        function->code.push_back(instruction);
+        return function->code.size() - 1;
+    }
+
+    void emit_extend(uint16_t reg, uint32_t type_id)
+    {
+        uint32_t op = extend_op(type_id);
+        if (op != Op::Count)
+        {
+            emit(op, reg);
+        }
+    }
+
+    // Points a jump emitted without a target to the next instruction
+    void patch_jump(uint32_t jump)
+    {
+        set_wide_operand(function->code[jump], function->code.size());
+    }
+
+    void emit_jump_back(uint32_t target)
+    {
+        set_wide_operand(function->code[emit(Op::Jump)], target);
+    }
+
+    // Returns the register holding the value of expr. Variables are used in
+    // place, anything else is evaluated into a temporary which the caller frees.
+    uint16_t lower_operand(ASTNode* expr, bool* is_temp)
+    {
+        if (expr->type == ASTNodeType::Identifier)
+        {
+            *is_temp = false;
+            return static_cast<ASTIdentifierNode*>(expr)->symbol->codegen_data.register_index;
+        }
+
+        *is_temp = true;
+        uint16_t temp = alloc_register();
+        lower_expr(expr, temp, true);
+        return temp;
+    }
+
+    // Lowers a leaf into dst, or opens a frame for an operator or call.
+    // If dst is a temporary nothing else reads, subexpressions may use it too.
+    void begin_expr(ASTNode* expr, uint16_t dst, bool dst_is_temp)
+    {
+        switch (expr->type)
+        {
+            case ASTNodeType::Number: {
+                ASTNumberNode* number = static_cast<ASTNumberNode*>(expr);
+                emit(Op::LoadConst, dst);
+                set_wide_operand(function->code.back(), function->constants.size());
+                function->constants.push_back(extend(number->value, number->type_id));
+            } break;
+            case ASTNodeType::Identifier:
+                emit(Op::Move, dst, static_cast<ASTIdentifierNode*>(expr)->symbol->codegen_data.register_index);
+                break;
+            case ASTNodeType::String: {
+                ASTStringNode* string = static_cast<ASTStringNode*>(expr);
+
+                // Copy and null terminate, the AST's arena outlives the program
+                char* str = (char*)ast.arena.alloc(string->str.len + 1, 1);
+                memcpy(str, string->str.start, string->str.len);
+                str[string->str.len] = 0;
+
+                emit(Op::LoadConst, dst);
+                set_wide_operand(function->code.back(), function->constants.size());
+                function->constants.push_back((int64_t)str);
+            } break;
+            case ASTNodeType::BinaryOperator: {
+                ExprFrame frame = {};
+                frame.expr = expr;
+                frame.dst = dst;
+                frame.dst_is_temp = dst_is_temp;
+                expr_frames.push_back(frame);
+            } break;
+            case ASTNodeType::FunctionCall: {
+                ExprFrame frame = {};
+                frame.expr = expr;
+                frame.dst = dst;
+                frame.dst_is_temp = dst_is_temp;
+                frame.next_arg = ast.sibling(ast.child(expr));
+
+                // Arguments go in consecutive registers, all allocated up front
+                // so evaluating one can't take the next one's register. The call
+                // reads them before writing dst, so the first can share a
+                // temporary dst on top of the registers in use, which keeps
+                // nested calls from using a register per level.
+                bool share_dst = dst_is_temp && dst + 1u == registers_used;
+                frame.first_arg = share_dst ? dst : registers_used;
+                for (ASTNode* arg = frame.next_arg; arg; arg = ast.sibling(arg))
+                {
+                    if (!share_dst || frame.arg_count > 0)
+                    {
+                        alloc_register();
+                        ++frame.args_allocated;
+                    }
+                    ++frame.arg_count;
+                }
+                frame.next_reg = frame.first_arg;
+
+                expr_frames.push_back(frame);
+            } break;
+            default:
+                assert(false && "Invalid syntax tree - expected a subexpression");
+        }
+    }
+
+    // Puts the operand in a register for a binary operator. Returns true if it
+    // needs to be evaluated first, which begin_expr is started on. That goes in
+    // the operator's own dst if it's a temporary the other operand isn't in,
+    // so chains of operators don't use a register per level.
+    bool begin_operand(ASTNode* operand, const ExprFrame& frame, uint16_t other_reg, uint16_t* reg, bool* is_temp)
+    {
+        if (operand->type == ASTNodeType::Identifier)
+        {
+            *is_temp = false;
+            *reg = static_cast<ASTIdentifierNode*>(operand)->symbol->codegen_data.register_index;
+            return false;
+        }
+
+        if (frame.dst_is_temp && frame.dst != other_reg)
+        {
+            *is_temp = false;
+            *reg = frame.dst;
+        }
+        else
+        {
+            *is_temp = true;
+            *reg = alloc_register();
+        }
+        begin_expr(operand, *reg, true);
+        return true;
+    }
+
+    // Evaluates expr into dst. Unless dst_is_temp, dst is only written by the
+    // last instruction, so expr may read the variable being assigned.
+    // Expressions can be nested arbitrarily deep, so this keeps an explicit
+    // stack instead of recursing.
+    void lower_expr(ASTNode* expr, uint16_t dst, bool dst_is_temp = false)
+    {
+        expr_frames.clear();
+
+        begin_expr(expr, dst, dst_is_temp);
+        while (!expr_frames.empty())
+        {
+            ExprFrame& frame = expr_frames.back();
+            if (frame.expr->type == ASTNodeType::BinaryOperator)
+            {
+                ASTBinOpNode* binop = static_cast<ASTBinOpNode*>(frame.expr);
+                ASTNode* lhs = ast.child(binop);
+
+                if (frame.operands_started == 0)
+                {
+                    frame.operands_started = 1;
+                    // Nothing is in dst yet
+                    if (begin_operand(lhs, frame, MAX_REGISTERS, &frame.lhs_reg, &frame.lhs_is_temp)) continue;
+                }
+
+                if (frame.operands_started == 1)
+                {
+                    frame.operands_started = 2;
+                    if (begin_operand(ast.sibling(lhs), frame, frame.lhs_reg, &frame.rhs_reg, &frame.rhs_is_temp)) continue;
+                }
+
+                uint32_t op;
+                switch (binop->op)
+                {
+                    case '+':
+                        op = Op::Add;
+                        break;
+                    case '-':
+                        op = Op::Sub;
+                        break;
+                    case '*':
+                        op = Op::Mul;
+                        break;
+                    case '<':
+                        op = binop->is_signed ? Op::LessSigned : Op::LessUnsigned;
+                        break;
+                    case '>':
+                        op = binop->is_signed ? Op::GreaterSigned : Op::GreaterUnsigned;
+                        break;
+                    default:
+                        assert(false && "Unsupported operator");
+                        return;
+                }
+
+                emit(op, frame.dst, frame.lhs_reg, frame.rhs_reg);
+                if (op == Op::Add || op == Op::Sub || op == Op::Mul)
+                {
+                    emit_extend(frame.dst, binop->type_id);
+                }
+
+                if (frame.rhs_is_temp) free_register();
+                if (frame.lhs_is_temp) free_register();
+
+                expr_frames.pop_back();
+                continue;
+            }
+
+            if (frame.next_arg)
+            {
+                ASTNode* arg = frame.next_arg;
+                frame.next_arg = ast.sibling(arg);
+                begin_expr(arg, frame.next_reg++, true);
+                continue;
+            }
+
+            SymbolData* callee = static_cast<ASTIdentifierNode*>(ast.child(frame.expr))->symbol;
+
+            // Every function was added up front, so this can't move the one being lowered
+            auto found = function_indices.find(callee->name_id);
+            assert(found != function_indices.end() && "Call to an undeclared function");
+            uint32_t callee_index = found->second;
+            functions[callee_index].called = true;
+
+            emit(Op::Call, frame.dst, frame.first_arg, callee_index);
+
+            // Defined functions already return extended values, C functions may not
+            if (!functions[callee_index].defined)
+            {
+                emit_extend(frame.dst, type_table_g.get(callee->type_id).base);
+            }
+
+            for (uint32_t i = 0; i < frame.args_allocated; ++i)
+            {
+                free_register();
+            }
+
+            expr_frames.pop_back();
+        }
+    }
+
+    void lower_statement_list(ASTNode* statement_list)
+    {
+        assert(statement_list->type == ASTNodeType::StatementList);
+
+        for (ASTNode* statement = ast.child(statement_list); statement; statement = ast.sibling(statement))
+        {
+            lower_statement(statement);
+        }
+    }
+
+    void lower_statement(ASTNode* statement)
+    {
+        switch (statement->type)
+        {
+            case ASTNodeType::VariableDef: {
+                SymbolData* symbol = static_cast<ASTIdentifierNode*>(statement)->symbol;
+                symbol->codegen_data.register_index = alloc_register();
+                lower_expr(ast.child(statement), symbol->codegen_data.register_index);
+            } break;
+            case ASTNodeType::Assignment: {
+                SymbolData* symbol = static_cast<ASTIdentifierNode*>(statement)->symbol;
+                lower_expr(ast.child(statement), symbol->codegen_data.register_index);
+            } break;
+            case ASTNodeType::FunctionDef:
+                // do nothing
+                break;
+            case ASTNodeType::Return:
+                if (ast.child(statement))
+                {
+                    bool is_temp;
+                    uint16_t reg = lower_operand(ast.child(statement), &is_temp);
+                    emit(Op::Return, reg);
+                    if (is_temp) free_register();
+                }
+                else
+                {
+                    emit(Op::ReturnNone);
+                }
+                break;
+            case ASTNodeType::If: {
+                ASTNode* then_list = ast.sibling(ast.child(statement));
+                ASTNode* else_list = ast.sibling(then_list);
+
+                bool is_temp;
+                uint16_t condition = lower_operand(ast.child(statement), &is_temp);
+                uint32_t to_else = emit(Op::JumpIfZero, condition);
+                if (is_temp) free_register();
+
+                lower_statement_list(then_list);
+
+                if (else_list)
+                {
+                    uint32_t to_end = emit(Op::Jump);
+                    patch_jump(to_else);
+                    lower_statement_list(else_list);
+                    patch_jump(to_end);
+                }
+                else
+                {
+                    patch_jump(to_else);
+                }
+            } break;
+            case ASTNodeType::While: {
+                uint32_t loop_start = function->code.size();
+
+                bool is_temp;
+                uint16_t condition = lower_operand(ast.child(statement), &is_temp);
+                uint32_t to_end = emit(Op::JumpIfZero, condition);
+                if (is_temp) free_register();
+
+                lower_statement_list(ast.sibling(ast.child(statement)));
+                emit_jump_back(loop_start);
+
+                patch_jump(to_end);
+            } break;
+            default: {
+                // An expression statement, the value is unused
+                uint16_t temp = alloc_register();
+                lower_expr(statement, temp, true);
+                free_register();
+            }
+        }
+    }
+
+    void lower_function_def(ASTNode* function_def)
+    {
+        ASTNode* parameter_list = ast.child(function_def);
+        ASTNode* statement_list = ast.sibling(parameter_list);
+
+        function = &functions[function_index(static_cast<ASTIdentifierNode*>(function_def)->symbol)];
+        registers_used = 0;
+
+        // Parameters take the first registers, where the caller puts the arguments
+        for (ASTNode* param = ast.child(parameter_list); param; param = ast.sibling(param))
+        {
+            static_cast<ASTIdentifierNode*>(param)->symbol->codegen_data.register_index = alloc_register();
+        }
+
+        lower_statement_list(statement_list);
+
+        // Falling off the end returns nothing
+        emit(Op::ReturnNone);
+
+        function = nullptr;
+    }
+
+    void lower_module()
+    {
+        // Every function is known before lowering any calls, so calls to
+        // defined ones can skip re-extending the result
+        for (ASTNode* node = ast.node(ast.start); node; node = ast.sibling(node))
+        {
+            assert(node->type == ASTNodeType::FunctionDef);
+
+            uint32_t index = function_index(static_cast<ASTIdentifierNode*>(node)->symbol);
+            if (ast.sibling(ast.child(node)))
+            {
+                assert(!functions[index].defined && "Function defined twice");
+                functions[index].defined = true;
+            }
+        }
+
+        for (ASTNode* node = ast.node(ast.start); node; node = ast.sibling(node))
+        {
+            if (ast.sibling(ast.child(node)))
+            {
+                lower_function_def(node);
+            }
+        }
+
+        // Only C functions which are actually called get looked up
+        for (BytecodeFunction& external : functions)
+        {
+            if (!external.defined && external.called)
+            {
+                std::string name(external.symbol->name.start, external.symbol->name.len);
+                if (type_table_g.get(external.symbol->type_id).param_count > MAX_EXTERNAL_ARGS)
+                {
+                    error = "C functions can take at most " + std::to_string(MAX_EXTERNAL_ARGS) + " arguments, " + name + " takes more";
+                    return;
+                }
+
+                external.external = dlsym(RTLD_DEFAULT, name.c_str());
+                if (!external.external)
+                {
+                    error = "Couldn't find " + name + " in this process";
+                    return;
+                }
+            }
+        }
+    }
+};
+
+// Calls a C function with integer arguments, under the System V calling convention
+static int64_t call_external(void* external, const int64_t* args, uint32_t arg_count)
+{
+    typedef int64_t I;
+    switch (arg_count)
+    {
+        case 0:
+            return ((I (*)())external)();
+        case 1:
+            return ((I (*)(I))external)(args[0]);
+        case 2:
+            return ((I (*)(I, I))external)(args[0], args[1]);
+        case 3:
+            return ((I (*)(I, I, I))external)(args[0], args[1], args[2]);
+        case 4:
+            return ((I (*)(I, I, I, I))external)(args[0], args[1], args[2], args[3]);
+        case 5:
+            return ((I (*)(I, I, I, I, I))external)(args[0], args[1], args[2], args[3], args[4]);
+        case 6:
+            return ((I (*)(I, I, I, I, I, I))external)(args[0], args[1], args[2], args[3], args[4], args[5]);
+        default:
+            // Checked when the function was looked up
+            assert(false && "Too many arguments for a C function");
+            return 0;
+    }
+}
+
+struct Interpreter
+{
+    const std::vector<BytecodeFunction>& functions;
+
+    // Left uninitialized, so only the pages actually used get touched
+    std::unique_ptr<int64_t[]> stack;
+    uint32_t stack_registers;
+
+    // Set when a call doesn't fit on the stack, every frame then returns straight away
+    bool overflowed = false;
+    uint32_t call_depth = 0;
+
+    Interpreter(const std::vector<BytecodeFunction>& functions_, uint32_t stack_registers_ = STACK_REGISTERS)
+    :functions(functions_),
+    stack(new int64_t[stack_registers_]),
+    stack_registers(stack_registers_)
+    {}
+
+    // Runs function with its arguments already in the first of regs
+    int64_t execute(const BytecodeFunction& function, int64_t* regs)
+    {
+        // Threaded dispatch, each handler jumps straight to the next one's
+        static void* const handlers[Op::Count] = {
+            &&load_const,
+            &&move,
+            &&add,
+            &&sub,
+            &&mul,
+            &&less_unsigned,
+            &&less_signed,
+            &&greater_unsigned,
+            &&greater_signed,
+            &&extend_u8,
+            &&extend_i8,
+            &&extend_u16,
+            &&extend_i16,
+            &&extend_u32,
+            &&extend_i32,
+            &&extend_bool,
+            &&jump,
+            &&jump_if_zero,
+            &&call,
+            &&return_value,
+            &&return_none,
+        };
+
+        const Instruction* code = function.code.data();
+        const int64_t* constants = function.constants.data();
+        const Instruction* ip = code;
+
+        #define DISPATCH() goto *handlers[ip->op]
+        #define NEXT() do { ++ip; DISPATCH(); } while (0)
+
+        DISPATCH();
+
+    load_const:
+        regs[ip->a] = constants[wide_operand(ip)];
+        NEXT();
+    move:
+        regs[ip->a] = regs[ip->b];
+        NEXT();
+
+        // Unsigned, so overflow wraps instead of being undefined
+    add:
+        regs[ip->a] = (uint64_t)regs[ip->b] + (uint64_t)regs[ip->c];
+        NEXT();
+    sub:
+        regs[ip->a] = (uint64_t)regs[ip->b] - (uint64_t)regs[ip->c];
+        NEXT();
+    mul:
+        regs[ip->a] = (uint64_t)regs[ip->b] * (uint64_t)regs[ip->c];
+        NEXT();
+    less_unsigned:
+        regs[ip->a] = (uint64_t)regs[ip->b] < (uint64_t)regs[ip->c];
+        NEXT();
+    less_signed:
+        regs[ip->a] = regs[ip->b] < regs[ip->c];
+        NEXT();
+    greater_unsigned:
+        regs[ip->a] = (uint64_t)regs[ip->b] > (uint64_t)regs[ip->c];
+        NEXT();
+    greater_signed:
+        regs[ip->a] = regs[ip->b] > regs[ip->c];
+        NEXT();
+
+    extend_u8:
+        regs[ip->a] = (uint8_t)regs[ip->a];
+        NEXT();
+    extend_i8:
+        regs[ip->a] = (int8_t)regs[ip->a];
+        NEXT();
+    extend_u16:
+        regs[ip->a] = (uint16_t)regs[ip->a];
+        NEXT();
+    extend_i16:
+        regs[ip->a] = (int16_t)regs[ip->a];
+        NEXT();
+    extend_u32:
+        regs[ip->a] = (uint32_t)regs[ip->a];
+        NEXT();
+    extend_i32:
+        regs[ip->a] = (int32_t)regs[ip->a];
+        NEXT();
+    extend_bool:
+        regs[ip->a] &= 1;
+        NEXT();
+
+    jump:
+        ip = code + wide_operand(ip);
+        DISPATCH();
+    jump_if_zero:
+        if (!regs[ip->a])
+        {
+            ip = code + wide_operand(ip);
+            DISPATCH();
+        }
+        NEXT();
+
+    call: {
+        const BytecodeFunction& callee = functions[ip->c];
+        const int64_t* args = regs + ip->b;
+        if (callee.external)
+        {
+            regs[ip->a] = call_external(callee.external, args, type_table_g.get(callee.symbol->type_id).param_count);
+        }
+        else
+        {
+            // The callee's frame goes after this one's
+            int64_t* callee_regs = regs + function.register_count;
+            if (callee_regs + callee.register_count > stack.get() + stack_registers || call_depth == MAX_CALL_DEPTH)
+            {
+                overflowed = true;
+                return 0;
+            }
+
+            memcpy(callee_regs, args, sizeof(int64_t) * type_table_g.get(callee.symbol->type_id).param_count);
+            ++call_depth;
+            regs[ip->a] = execute(callee, callee_regs);
+            --call_depth;
+            if (overflowed) return 0;
+        }
+        NEXT();
+    }
+
+    return_value:
+        return regs[ip->a];
+    return_none:
+        return 0;
+
+        #undef NEXT
+        #undef DISPATCH
+    }
+};
+
+bool interpret_ast(AST& ast, const int64_t* args, uint32_t arg_count, int64_t* result, std::string* error)
+{
+    BytecodeLowering lowering(ast);
+    lowering.lower_module();
+    if (!lowering.error.empty())
+    {
+        *error = lowering.error;
+        return false;
+    }
+
+    const BytecodeFunction* main_function = nullptr;
+    for (const BytecodeFunction& function : lowering.functions)
+    {
+        if (function.defined && function.symbol->name == "main")
+        {
+            main_function = &function;
+        }
+    }
+
+    if (!main_function)
+    {
+        *error = "Nothing to run, main isn't defined";
+        return false;
+    }
+
+    const TypeInfo& main_type = type_table_g.get(main_function->symbol->type_id);
+    if (arg_count != main_type.param_count)
+    {
+        *error = "main takes " + std::to_string(main_type.param_count) + " arguments, but " + std::to_string(arg_count) + " were given";
+        return false;
+    }
+
+    Interpreter interpreter(lowering.functions);
+    for (uint32_t i = 0; i < arg_count; ++i)
+    {
+        interpreter.stack[i] = extend(args[i], main_type.param_types[i]);
+    }
+
+    *result = interpreter.execute(*main_function, interpreter.stack.get());
+    if (interpreter.overflowed)
+    {
+        *error = "Stack overflow";
+        return false;
+    }
+    return true;
+}
+
+bool evaluate_constant(AST& ast, ASTNode* expr, int64_t* result)
+{
+    // Only numbers and operators on them can be evaluated without a program around them
+    std::vector<ASTNode*> stack(1, expr);
+    while (!stack.empty())
+    {
+        ASTNode* node = stack.back();
+        stack.pop_back();
+
+        if (node->type != ASTNodeType::Number && node->type != ASTNodeType::BinaryOperator) return false;
+
+        for (ASTNode* child = ast.child(node); child; child = ast.sibling(child))
+        {
+            stack.push_back(child);
+        }
+    }
+
+    // Lowered as the body of a function without a symbol, which nothing calls
+    BytecodeLowering lowering(ast);
+    BytecodeFunction function;
+    function.symbol = nullptr;
+    lowering.function = &function;
+
+    uint16_t reg = lowering.alloc_register();
+    lowering.lower_expr(expr, reg, true);
+    lowering.emit(Op::Return, reg);
+    if (!lowering.error.empty())
+    {
+        return false;
+    }
+
+    Interpreter interpreter(lowering.functions, function.register_count);
+    *result = interpreter.execute(function, interpreter.stack.get());
+    return true;
+}
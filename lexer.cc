@@ -1,8 +1,11 @@
 #include "lexer.h"
+#include "lexer_scan.h"
 #include "parser.h"
 #include "report_error.h"
 #include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <thread>
 
 #include <iostream>
 
@@ -24,6 +27,18 @@ bool SubString::operator==(const SubString& rhs)
     return true;
 }
 
+// FNV-1a
+uint32_t SubString::hash() const
+{
+    uint32_t result = 2166136261u;
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        result ^= (uint8_t)start[i];
+        result *= 16777619u;
+    }
+    return result;
+}
+
 bool operator==(const SubString& lhs, const char* rhs)
 {
     uint32_t i = 0;
@@ -55,142 +70,257 @@ static uint64_t string_to_unsigned(const char* start, uint32_t len)
     return result;
 }
 
-static bool is_number(char c)
+namespace CharClass
 {
-    return c >= '0' && c <= '9';
+    enum : uint8_t
+    {
+        Digit = 1 << 0,
+        Identifier = 1 << 1,        // letters, digits and '_'
+        SingleCharToken = 1 << 2,
+        Whitespace = 1 << 3,
+        Quote = 1 << 4,
+        Blank = 1 << 5,             // whitespace other than newlines
+    };
 }
 
-// TODO: This may be misleading when we have e.g. < and <<
-static bool is_single_char_token(char c)
+// Classification of every byte, so that each test in the lexer is a single load.
+// Bytes that aren't listed (including the NUL terminator) have no class.
+static const uint8_t CHAR_CLASS[256] = {
+    ['0'] = CharClass::Digit | CharClass::Identifier, ['1'] = CharClass::Digit | CharClass::Identifier,
+    ['2'] = CharClass::Digit | CharClass::Identifier, ['3'] = CharClass::Digit | CharClass::Identifier,
+    ['4'] = CharClass::Digit | CharClass::Identifier, ['5'] = CharClass::Digit | CharClass::Identifier,
+    ['6'] = CharClass::Digit | CharClass::Identifier, ['7'] = CharClass::Digit | CharClass::Identifier,
+    ['8'] = CharClass::Digit | CharClass::Identifier, ['9'] = CharClass::Digit | CharClass::Identifier,
+    ['a'] = CharClass::Identifier, ['b'] = CharClass::Identifier, ['c'] = CharClass::Identifier, ['d'] = CharClass::Identifier,
+    ['e'] = CharClass::Identifier, ['f'] = CharClass::Identifier, ['g'] = CharClass::Identifier, ['h'] = CharClass::Identifier,
+    ['i'] = CharClass::Identifier, ['j'] = CharClass::Identifier, ['k'] = CharClass::Identifier, ['l'] = CharClass::Identifier,
+    ['m'] = CharClass::Identifier, ['n'] = CharClass::Identifier, ['o'] = CharClass::Identifier, ['p'] = CharClass::Identifier,
+    ['q'] = CharClass::Identifier, ['r'] = CharClass::Identifier, ['s'] = CharClass::Identifier, ['t'] = CharClass::Identifier,
+    ['u'] = CharClass::Identifier, ['v'] = CharClass::Identifier, ['w'] = CharClass::Identifier, ['x'] = CharClass::Identifier,
+    ['y'] = CharClass::Identifier, ['z'] = CharClass::Identifier,
+    ['A'] = CharClass::Identifier, ['B'] = CharClass::Identifier, ['C'] = CharClass::Identifier, ['D'] = CharClass::Identifier,
+    ['E'] = CharClass::Identifier, ['F'] = CharClass::Identifier, ['G'] = CharClass::Identifier, ['H'] = CharClass::Identifier,
+    ['I'] = CharClass::Identifier, ['J'] = CharClass::Identifier, ['K'] = CharClass::Identifier, ['L'] = CharClass::Identifier,
+    ['M'] = CharClass::Identifier, ['N'] = CharClass::Identifier, ['O'] = CharClass::Identifier, ['P'] = CharClass::Identifier,
+    ['Q'] = CharClass::Identifier, ['R'] = CharClass::Identifier, ['S'] = CharClass::Identifier, ['T'] = CharClass::Identifier,
+    ['U'] = CharClass::Identifier, ['V'] = CharClass::Identifier, ['W'] = CharClass::Identifier, ['X'] = CharClass::Identifier,
+    ['Y'] = CharClass::Identifier, ['Z'] = CharClass::Identifier,
+    ['_'] = CharClass::Identifier,
+    // TODO: This may be misleading when we have e.g. < and <<
+    ['('] = CharClass::SingleCharToken, [')'] = CharClass::SingleCharToken,
+    ['{'] = CharClass::SingleCharToken, ['}'] = CharClass::SingleCharToken,
+    ['+'] = CharClass::SingleCharToken, ['-'] = CharClass::SingleCharToken,
+    ['*'] = CharClass::SingleCharToken, ['='] = CharClass::SingleCharToken,
+    [':'] = CharClass::SingleCharToken, [','] = CharClass::SingleCharToken,
+    ['<'] = CharClass::SingleCharToken, ['>'] = CharClass::SingleCharToken,
+    [';'] = CharClass::SingleCharToken,
+    [' '] = CharClass::Whitespace | CharClass::Blank, ['\t'] = CharClass::Whitespace | CharClass::Blank,
+    ['\r'] = CharClass::Whitespace | CharClass::Blank, ['\n'] = CharClass::Whitespace,
+    ['"'] = CharClass::Quote,
+};
+
+static bool char_is(char c, uint8_t char_class)
+{
+    return CHAR_CLASS[(uint8_t)c] & char_class;
+}
+
+static bool is_number(char c)
 {
-    return (c == '(') ||
-           (c == ')') ||
-           (c == '{') ||
-           (c == '}') ||
-           (c == '+') ||
-           (c == '-') ||
-           (c == '*') ||
-           (c == '=') ||
-           (c == ':') ||
-           (c == ',') ||
-           (c == '<') ||
-           (c == '>') ||
-           (c == ';');
+    return char_is(c, CharClass::Digit);
 }
 
-static bool is_whitespace(char c)
+static bool is_single_char_token(char c)
 {
-    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    return char_is(c, CharClass::SingleCharToken);
 }
 
 static bool valid_identifier_char(char c)
 {
-    return (c >= 'a' && c <= 'z') ||
-        (c >= 'A' && c <= 'Z') ||
-        (c >= '0' && c <= '9') ||
-        (c == '_');
+    return char_is(c, CharClass::Identifier);
 }
 
 static bool valid_token_char(char c)
 {
-    return valid_identifier_char(c) || is_single_char_token(c) || c == '"';
+    return char_is(c, CharClass::Identifier | CharClass::SingleCharToken | CharClass::Quote);
 }
 
 static bool valid_terminator(char c)
 {
-    return is_single_char_token(c) || is_whitespace(c);
+    return char_is(c, CharClass::SingleCharToken | CharClass::Whitespace);
 }
 
-static Token get_keyword_token(SubString word)
+// Keywords and builtin type names are found with a perfect hash on the first
+// and last characters. Every entry in KEYWORD_TABLE sits in the slot its name
+// hashes to, which is checked at compile time below, so a lookup is one
+// hash, one length compare and at most one memcmp.
+constexpr uint32_t KEYWORD_TABLE_SIZE = 32;
+
+constexpr uint32_t keyword_hash(const char* word, uint32_t len)
 {
-    Token result;
-    if (word == "return")
-    {
-        result.type = TokenType::Return;
-    }
-    else if (word == "if")
-    {
-        result.type = TokenType::If;
-    }
-    else if (word == "else")
-    {
-        result.type = TokenType::Else;
-    }
-    else if (word == "while")
-    {
-        result.type = TokenType::While;
-    }
-    else if (word == "u8")
-    {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::U8;
-    }
-    else if (word == "u16")
-    {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::U16;
-    }
-    else if (word == "u32")
-    {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::U32;
-    }
-    else if (word == "u64")
-    {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::U64;
-    }
-    else if (word == "i8")
-    {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::I8;
-    }
-    else if (word == "i16")
+    return ((uint8_t)word[0] + (uint8_t)word[len - 1]) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+struct Keyword
+{
+    const char* name;
+    uint32_t len;
+    uint32_t token_type;
+    uint32_t type_id;
+};
+
+constexpr Keyword KEYWORD_TABLE[KEYWORD_TABLE_SIZE] = {
+    /*  0 */ {"return", 6, TokenType::Return, TypeId::Invalid},
+    /*  1 */ {"i8", 2, TokenType::TypeName, TypeId::I8},
+    /*  2 */ {"pointer", 7, TokenType::TypeName, TypeId::Pointer},
+    /*  3 */ {}, {}, {}, {},
+    /*  7 */ {"u32", 3, TokenType::TypeName, TypeId::U32},
+    /*  8 */ {},
+    /*  9 */ {"u64", 3, TokenType::TypeName, TypeId::U64},
+    /* 10 */ {"else", 4, TokenType::Else, TypeId::Invalid},
+    /* 11 */ {"u16", 3, TokenType::TypeName, TypeId::U16},
+    /* 12 */ {},
+    /* 13 */ {"u8", 2, TokenType::TypeName, TypeId::U8},
+    /* 14 */ {"bool", 4, TokenType::TypeName, TypeId::Bool},
+    /* 15 */ {"if", 2, TokenType::If, TypeId::Invalid},
+    /* 16 */ {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {},
+    /* 27 */ {"i32", 3, TokenType::TypeName, TypeId::I32},
+    /* 28 */ {"while", 5, TokenType::While, TypeId::Invalid},
+    /* 29 */ {"i64", 3, TokenType::TypeName, TypeId::I64},
+    /* 30 */ {},
+    /* 31 */ {"i16", 3, TokenType::TypeName, TypeId::I16},
+};
+
+constexpr bool keyword_table_is_perfect(uint32_t slot = 0)
+{
+    return slot == KEYWORD_TABLE_SIZE
+        || ((!KEYWORD_TABLE[slot].name
+             || keyword_hash(KEYWORD_TABLE[slot].name, KEYWORD_TABLE[slot].len) == slot)
+            && keyword_table_is_perfect(slot + 1));
+}
+
+static_assert(keyword_table_is_perfect(), "Keyword table entry is not in its hash slot");
+
+// Pushes either a keyword, a type name or a name token
+static void push_word_token(TokenStream& tokens, SubString word, uint32_t offset, bool intern_names)
+{
+    const Keyword& keyword = KEYWORD_TABLE[keyword_hash(word.start, word.len)];
+    if (keyword.len == word.len && memcmp(keyword.name, word.start, word.len) == 0)
     {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::I16;
+        tokens.push(keyword.token_type, offset, keyword.type_id);
     }
-    else if (word == "i32")
+    else
     {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::I32;
+        tokens.push(TokenType::Name, offset, intern_names ? interner_g.intern(word) : word.len);
     }
-    else if (word == "i64")
+}
+
+// Most runs are short, and finishing those inline is cheaper than calling out
+// to a vector kernel. Only runs longer than this are handed to the kernel.
+constexpr uint32_t SHORT_RUN_LENGTH = 16;
+
+static uint32_t skip_run(const char* file, uint32_t position, uint8_t char_class, const char* (*kernel)(const char*))
+{
+    for (uint32_t i = 0; i < SHORT_RUN_LENGTH; ++i, ++position)
     {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::I64;
+        if (!char_is(file[position], char_class)) return position;
     }
-    else if (word == "bool")
+
+    return kernel(file + position) - file;
+}
+
+SubString TokenStream::str(uint32_t token) const
+{
+    SubString result;
+    if (type(token) == TokenType::String)
     {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::Bool;
+        // TODO: Right now a string is just all the characters between "...",
+        // including newlines etc.
+        result.start = source->data + offset(token) + 1;
+        result.len = data[token & window_mask] - 2;
     }
-    else if (word == "pointer")
+    else
     {
-        result.type = TokenType::TypeName;
-        result.type_id = TypeId::Pointer;
+        result = interner_g.get(name_id(token));
     }
-    else
+    return result;
+}
+
+uint32_t TokenStream::name_id(uint32_t token) const
+{
+    assert(type(token) == TokenType::Name);
+    return data[token & window_mask];
+}
+
+uint64_t TokenStream::number_value(uint32_t token) const
+{
+    assert(type(token) == TokenType::Number);
+    return number_values[data[token & window_mask]];
+}
+
+uint32_t TokenStream::type_id(uint32_t token) const
+{
+    assert(type(token) == TokenType::TypeName);
+    return data[token & window_mask];
+}
+
+uint32_t TokenStream::len(uint32_t token) const
+{
+    switch (type(token))
     {
-        result.type = TokenType::Name;
-        result.str = word;
+        case TokenType::Name:
+            return interner_g.get(name_id(token)).len;
+        case TokenType::String:
+            return data[token & window_mask];
+        case TokenType::Return:
+        case TokenType::TypeName:
+        case TokenType::Number:
+        case TokenType::If:
+        case TokenType::Else:
+        case TokenType::While: {
+            uint32_t end = offset(token);
+            while (valid_identifier_char(source->data[end])) ++end;
+            return end - offset(token);
+        }
+        case TokenType::Invalid:
+            return 0;
+        default:
+            return 1;
     }
+}
 
-    return result;
+void Lexer::init(SourceFile& source_, TokenStream& tokens_)
+{
+    init_chunk(source_, tokens_, 0, source_.len);
+    intern_names = true;
+
+    line_starts = &source->line_starts;
+    line_starts->clear();
+    line_starts->push_back(0);
+}
+
+void Lexer::init_chunk(SourceFile& source_, TokenStream& tokens_, uint32_t start, uint32_t end_)
+{
+    source = &source_;
+    tokens = &tokens_;
+    position = start;
+    end = end_;
+    line_starts = nullptr;
+    intern_names = false;
+    scan = &get_lexer_scan_kernels();
+
+    tokens->source = source;
 }
 
-void lex(const char* file, std::vector<Token>& tokens)
+bool Lexer::lex_token()
 {
-    uint32_t position = 0;
-    uint32_t line = 0;
-    uint32_t line_start = 0;
-    while (file[position])
+    const char* file = source->data;
+
+    while (position < end && file[position])
     {
         if (file[position] == '\n')
         {
-            ++line;
-            ++position;
-            line_start = position;
+            if (line_starts) line_starts->push_back(position + 1);
+            position = skip_run(file, position + 1, CharClass::Blank, scan->skip_blanks);
         }
         else if (valid_token_char(file[position]))
         {
@@ -202,82 +332,216 @@ void lex(const char* file, std::vector<Token>& tokens)
                     ++position;
                 }
 
-                compile_assert_with_marker(valid_terminator(file[position]), "Invalid character terminating token", line, identifier_start - line_start, 1);
-
-                Token new_token;
-                new_token.type = TokenType::Number,
-                new_token.line = line,
-                new_token.column = identifier_start - line_start,
-                new_token.len = position - identifier_start,
-                new_token.number_value = string_to_unsigned(file + identifier_start, new_token.len);
+                compile_assert_at_offset(valid_terminator(file[position]), "Invalid character terminating token", *source, identifier_start, 1);
 
-                tokens.push_back(new_token);
+                tokens->push_number(identifier_start, string_to_unsigned(file + identifier_start, position - identifier_start));
             }
             else if (valid_identifier_char(file[position]))
             {
                 uint32_t identifier_start = position;
-                while (valid_identifier_char(file[position]))
-                {
-                    ++position;
-                }
-                
-                compile_assert_with_marker(valid_terminator(file[position]), "Invalid character terminating token", line, identifier_start - line_start, 1);
+                position = skip_run(file, position, CharClass::Identifier, scan->skip_identifier_chars);
+
+                compile_assert_at_offset(valid_terminator(file[position]), "Invalid character terminating token", *source, identifier_start, 1);
 
                 SubString token_name;
                 token_name.start = file + identifier_start;
                 token_name.len = position - identifier_start;
 
-                Token new_token = get_keyword_token(token_name);
-                new_token.line = line;
-                new_token.column = identifier_start - line_start;
-                new_token.len = position - identifier_start;
-                
-                tokens.push_back(new_token);
+                push_word_token(*tokens, token_name, identifier_start, intern_names);
             }
             else if (is_single_char_token(file[position]))
             {
-                Token new_token;
-                new_token.type = file[position];
-                new_token.line = line;
-                new_token.column = position - line_start;
-                new_token.len = 1;
-
-                tokens.push_back(new_token);
+                tokens->push(file[position], position);
                 ++position;
             }
             else if (file[position] == '"')
             {
-                // TODO: Right now a string is just all the characters between "...",
-                // including newlines etc.
                 uint32_t string_start = position;
-                do
-                {
-                    ++position;
-                } while (file[position] != '"');
-
-                Token new_token;
-                new_token.type = TokenType::String;
-                new_token.line = line;
-                new_token.column = string_start - line_start;
-                new_token.len = position - string_start;
+                position = scan->find_string_end(file + position + 1) - file;
 
-                SubString str;
-                str.start = file + string_start + 1;
-                str.len = position - string_start - 2;
+                compile_assert_at_offset(file[position] == '"', "Unterminated string", *source, string_start, 1);
 
-                new_token.str = str;
+                // Strings can contain newlines
+                if (line_starts)
+                {
+                    for (uint32_t i = string_start + 1; i < position; ++i)
+                    {
+                        if (file[i] == '\n') line_starts->push_back(i + 1);
+                    }
+                }
 
-                tokens.push_back(new_token);
+                tokens->push(TokenType::String, string_start, position - string_start);
                 ++position;
             }
             else
             {
-                compile_fail_with_marker("Invalid character", line, position - line_start, 1);
+                compile_fail_at_offset("Invalid character", *source, position, 1);
             }
+
+            return true;
         }
         else
         {
-            ++position;
+            // Skip this character along with any blanks after it
+            position = skip_run(file, position + 1, CharClass::Blank, scan->skip_blanks);
         }
     }
+
+    return false;
+}
+
+// Files smaller than this aren't worth splitting up
+constexpr uint32_t MIN_PARALLEL_CHUNK_SIZE = 1 << 20;
+
+struct LexChunk
+{
+    uint32_t start = 0;
+    uint32_t end = 0;
+
+    // Filled in by the pre-pass over the chunk's original byte range
+    uint32_t quote_count = 0;
+    std::vector<uint32_t> line_starts;
+
+    TokenStream tokens;
+};
+
+// Records every line start in [start, end) and counts the quotes
+static void scan_chunk_lines_and_quotes(const char* file, LexChunk& chunk)
+{
+    for (uint32_t i = chunk.start; i < chunk.end; ++i)
+    {
+        if (file[i] == '\n') chunk.line_starts.push_back(i + 1);
+        if (file[i] == '"') ++chunk.quote_count;
+    }
+}
+
+// Strings can't contain escaped quotes, so a position is outside any string
+// exactly when an even number of quotes come before it. Starting from
+// position, with quote_parity quotes before it, finds the first line start
+// which is outside a string.
+static uint32_t find_safe_split(const char* file, uint32_t position, uint32_t end, uint32_t quote_parity)
+{
+    for (; position < end; ++position)
+    {
+        if (file[position] == '"') quote_parity ^= 1;
+        if (file[position] == '\n' && !quote_parity) return position + 1;
+    }
+    return end;
+}
+
+static void lex_parallel(SourceFile& source, TokenStream& tokens, uint32_t chunk_count)
+{
+    const char* file = source.data;
+    std::vector<LexChunk> chunks(chunk_count);
+
+    // Pre-pass: split the file evenly and find the line starts and quotes in each part.
+    // This also builds the complete line start table before any lexing, so
+    // errors from any thread can be reported properly.
+    {
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < chunk_count; ++i)
+        {
+            chunks[i].start = (uint64_t)source.len * i / chunk_count;
+            chunks[i].end = (uint64_t)source.len * (i + 1) / chunk_count;
+            threads.emplace_back(scan_chunk_lines_and_quotes, file, std::ref(chunks[i]));
+        }
+        for (std::thread& thread : threads) thread.join();
+    }
+
+    source.line_starts.clear();
+    source.line_starts.push_back(0);
+    for (LexChunk& chunk : chunks)
+    {
+        source.line_starts.insert(source.line_starts.end(), chunk.line_starts.begin(), chunk.line_starts.end());
+    }
+
+    // Move each split forward to the next line start outside a string
+    uint32_t quote_parity = 0;
+    for (uint32_t i = 1; i < chunk_count; ++i)
+    {
+        quote_parity ^= chunks[i - 1].quote_count & 1;
+
+        uint32_t split = find_safe_split(file, chunks[i].start, source.len, quote_parity);
+        split = std::max(split, chunks[i - 1].start);
+
+        chunks[i - 1].end = split;
+        chunks[i].start = split;
+    }
+    chunks.back().end = source.len;
+
+    // Lex each chunk on its own thread
+    {
+        std::vector<std::thread> threads;
+        for (LexChunk& chunk : chunks)
+        {
+            threads.emplace_back([&source, &chunk]() {
+                Lexer lexer;
+                lexer.init_chunk(source, chunk.tokens, chunk.start, chunk.end);
+                while (lexer.lex_token());
+            });
+        }
+        for (std::thread& thread : threads) thread.join();
+    }
+
+    // Offsets are already relative to the whole file, so concatenating chunks
+    // only needs number indices to be fixed up, and names to be interned.
+    // Interning in file order here also keeps ids the same as when lexing
+    // on one thread.
+    tokens.source = &source;
+
+    uint32_t token_count = 0;
+    for (const LexChunk& chunk : chunks) token_count += chunk.tokens.size();
+
+    tokens.types.reserve(token_count);
+    tokens.offsets.reserve(token_count);
+    tokens.data.reserve(token_count);
+
+    for (const LexChunk& chunk : chunks)
+    {
+        uint32_t number_base = tokens.number_values.size();
+        for (uint32_t i = 0; i < chunk.tokens.size(); ++i)
+        {
+            uint32_t token_data = chunk.tokens.data[i];
+            if (chunk.tokens.types[i] == TokenType::Number)
+            {
+                token_data += number_base;
+            }
+            else if (chunk.tokens.types[i] == TokenType::Name)
+            {
+                SubString name;
+                name.start = file + chunk.tokens.offsets[i];
+                name.len = token_data;
+                token_data = interner_g.intern(name);
+            }
+
+            tokens.push(chunk.tokens.types[i], chunk.tokens.offsets[i], token_data);
+        }
+
+        tokens.number_values.insert(tokens.number_values.end(), chunk.tokens.number_values.begin(), chunk.tokens.number_values.end());
+    }
+}
+
+static uint32_t parallel_chunk_count(const SourceFile& source)
+{
+    return std::min<uint32_t>(std::thread::hardware_concurrency(), source.len / MIN_PARALLEL_CHUNK_SIZE);
+}
+
+bool lexes_in_parallel(const SourceFile& source)
+{
+    return parallel_chunk_count(source) > 1;
+}
+
+void lex(SourceFile& source, TokenStream& tokens)
+{
+    uint32_t chunk_count = parallel_chunk_count(source);
+    if (chunk_count > 1)
+    {
+        lex_parallel(source, tokens, chunk_count);
+        return;
+    }
+
+    Lexer lexer;
+    lexer.init(source, tokens);
+
+    while (lexer.lex_token());
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "util.h"
+#include "source_file.h"
+#include "intern.h"
 #include <vector>
 #include <stdint.h>
 
@@ -23,27 +25,144 @@ namespace TokenType
     };
 }
 
-struct Token
+// Tokens are stored as parallel arrays rather than an array of structs, since
+// the parser mostly only looks at token types.
+// Lines and columns aren't stored at all, they're worked out from the offset
+// when an error is reported.
+struct TokenStream
 {
-    uint32_t type = TokenType::Invalid;
+    // Source the tokens point into
+    const SourceFile* source = nullptr;
 
-    // Used in error messages
-    uint32_t line = 0;
-    uint32_t column = 0;
-    uint32_t len = 0;
+    // Total number of tokens pushed
+    uint32_t count = 0;
 
-    union
+    // When tokens are lexed on demand only the most recent ones are kept, and the
+    // arrays below are ring buffers indexed by (token & window_mask).
+    // Otherwise every token is kept and the mask has no effect.
+    uint32_t window_mask = UINT32_MAX;
+
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> offsets;
+
+    // Meaning depends on the token type:
+    //   Name:     id of the name in interner_g
+    //   String:   length of the token, including the opening quote
+    //   TypeName: type id, for default type names like u32 etc
+    //   Number:   index into number_values
+    std::vector<uint32_t> data;
+    std::vector<uint64_t> number_values;
+
+    // Only keep the last window_size tokens, which must be a power of 2
+    void init_window(uint32_t window_size)
     {
-        uint64_t number_value;
-        SubString str;
-        uint32_t type_id;       // for default type names, like u32 etc
-    };
+        assert(window_size && !(window_size & (window_size - 1)));
+        assert(!count);
+
+        window_mask = window_size - 1;
+        types.resize(window_size);
+        offsets.resize(window_size);
+        data.resize(window_size);
+        number_values.resize(window_size);
+    }
+
+    uint32_t size() const
+    {
+        return count;
+    }
+
+    bool in_window(uint32_t token) const
+    {
+        return token < count && count - token - 1 <= window_mask;
+    }
+
+    uint32_t type(uint32_t token) const
+    {
+        assert(in_window(token));
+        return types[token & window_mask];
+    }
+
+    uint32_t offset(uint32_t token) const
+    {
+        assert(in_window(token));
+        return offsets[token & window_mask];
+    }
 
-    Token()
+    void push(uint32_t type, uint32_t offset, uint32_t token_data = 0)
     {
-        // hack to un-delete default token constructor
-        str = SubString();
+        if (window_mask == UINT32_MAX)
+        {
+            types.push_back(type);
+            offsets.push_back(offset);
+            data.push_back(token_data);
+        }
+        else
+        {
+            uint32_t slot = count & window_mask;
+            types[slot] = type;
+            offsets[slot] = offset;
+            data[slot] = token_data;
+        }
+        ++count;
     }
+
+    void push_number(uint32_t offset, uint64_t value)
+    {
+        if (window_mask == UINT32_MAX)
+        {
+            push(TokenType::Number, offset, number_values.size());
+            number_values.push_back(value);
+        }
+        else
+        {
+            // Numbers share the slot of their token
+            uint32_t slot = count & window_mask;
+            number_values[slot] = value;
+            push(TokenType::Number, offset, slot);
+        }
+    }
+
+    SubString str(uint32_t token) const;
+    uint32_t name_id(uint32_t token) const;
+    uint64_t number_value(uint32_t token) const;
+    uint32_t type_id(uint32_t token) const;
+
+    // Length of the token in the source. Only needed for error messages,
+    // so it's recomputed from the source for tokens that don't store it.
+    uint32_t len(uint32_t token) const;
 };
 
-void lex(const char* file, std::vector<Token>& tokens);
+struct LexerScanKernels;
+
+// Lexes one token at a time, so that tokens can be produced as the parser asks for them.
+struct Lexer
+{
+    SourceFile* source = nullptr;
+    TokenStream* tokens = nullptr;
+    uint32_t position = 0;
+    uint32_t end = 0;
+
+    // Line starts are recorded here as lexing goes, unless it's null
+    std::vector<uint32_t>* line_starts = nullptr;
+
+    bool intern_names = true;
+
+    const LexerScanKernels* scan = nullptr;
+
+    // Also resets the file's line start table, which is filled in as lexing goes
+    void init(SourceFile& source_, TokenStream& tokens_);
+
+    // Lexes only [start, end), which must begin and end outside any token.
+    // Doesn't record line starts, and since the interner isn't thread safe,
+    // Name tokens hold the length of the name rather than an id.
+    void init_chunk(SourceFile& source_, TokenStream& tokens_, uint32_t start, uint32_t end_);
+
+    // Pushes the next token onto tokens. Returns false at the end of the file.
+    bool lex_token();
+};
+
+// Lexes the whole file. Large files are split into chunks which are lexed in parallel.
+void lex(SourceFile& source, TokenStream& tokens);
+
+// True if lex would split the file up, since it's big enough and there's more than one core
+bool lexes_in_parallel(const SourceFile& source);
@@ -0,0 +1,221 @@
+#include "lexer_scan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LEXER_SCAN_X86
+#include <immintrin.h>
+#endif
+
+// -------------
+// Scalar
+// -------------
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool is_identifier_char(char c)
+{
+    return (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') ||
+        (c == '_');
+}
+
+static const char* skip_blanks_scalar(const char* p)
+{
+    while (is_blank(*p)) ++p;
+    return p;
+}
+
+static const char* skip_identifier_chars_scalar(const char* p)
+{
+    while (is_identifier_char(*p)) ++p;
+    return p;
+}
+
+static const char* find_string_end_scalar(const char* p)
+{
+    while (*p && *p != '"') ++p;
+    return p;
+}
+
+static const LexerScanKernels SCALAR_KERNELS = {
+    skip_blanks_scalar,
+    skip_identifier_chars_scalar,
+    find_string_end_scalar,
+    "scalar",
+};
+
+const LexerScanKernels& get_scalar_lexer_scan_kernels()
+{
+    return SCALAR_KERNELS;
+}
+
+#ifdef LEXER_SCAN_X86
+
+// The vector kernels load whole aligned blocks, starting with the block
+// containing p, and build a bitmask of the bytes that end the run.
+// Bits for bytes before p are shifted out of the first block.
+
+// -------------
+// SSE2
+// -------------
+
+__attribute__((target("sse2")))
+static __m128i in_range_16(__m128i chars, char lo, char hi)
+{
+    // Signed compares are fine since everything we look for is ASCII,
+    // and bytes >= 0x80 compare as negative.
+    return _mm_and_si128(
+        _mm_cmpgt_epi8(chars, _mm_set1_epi8(lo - 1)),
+        _mm_cmplt_epi8(chars, _mm_set1_epi8(hi + 1)));
+}
+
+__attribute__((target("sse2")))
+static uint32_t blank_end_mask_16(__m128i chars)
+{
+    __m128i blank = _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')),
+            _mm_cmpeq_epi8(chars, _mm_set1_epi8('\t'))),
+        _mm_cmpeq_epi8(chars, _mm_set1_epi8('\r')));
+    return ~_mm_movemask_epi8(blank) & 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static uint32_t identifier_end_mask_16(__m128i chars)
+{
+    __m128i identifier = _mm_or_si128(
+        _mm_or_si128(in_range_16(chars, 'a', 'z'), in_range_16(chars, 'A', 'Z')),
+        _mm_or_si128(in_range_16(chars, '0', '9'), _mm_cmpeq_epi8(chars, _mm_set1_epi8('_'))));
+    return ~_mm_movemask_epi8(identifier) & 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static uint32_t string_end_mask_16(__m128i chars)
+{
+    __m128i end = _mm_or_si128(
+        _mm_cmpeq_epi8(chars, _mm_set1_epi8('"')),
+        _mm_cmpeq_epi8(chars, _mm_setzero_si128()));
+    return _mm_movemask_epi8(end);
+}
+
+#define DEFINE_SCAN_16(name, end_mask)                                          \
+    __attribute__((target("sse2")))                                             \
+    static const char* name(const char* p)                                      \
+    {                                                                           \
+        const char* block = (const char*)((uintptr_t)p & ~(uintptr_t)15);     \
+        uint32_t mask = end_mask(_mm_load_si128((const __m128i*)block)) >> (p - block); \
+        if (mask) return p + __builtin_ctz(mask);                               \
+        while (true)                                                            \
+        {                                                                       \
+            block += 16;                                                        \
+            mask = end_mask(_mm_load_si128((const __m128i*)block));             \
+            if (mask) return block + __builtin_ctz(mask);                       \
+        }                                                                       \
+    }
+
+DEFINE_SCAN_16(skip_blanks_sse2, blank_end_mask_16)
+DEFINE_SCAN_16(skip_identifier_chars_sse2, identifier_end_mask_16)
+DEFINE_SCAN_16(find_string_end_sse2, string_end_mask_16)
+
+static const LexerScanKernels SSE2_KERNELS = {
+    skip_blanks_sse2,
+    skip_identifier_chars_sse2,
+    find_string_end_sse2,
+    "sse2",
+};
+
+// -------------
+// AVX2
+// -------------
+
+__attribute__((target("avx2")))
+static __m256i in_range_32(__m256i chars, char lo, char hi)
+{
+    return _mm256_and_si256(
+        _mm256_cmpgt_epi8(chars, _mm256_set1_epi8(lo - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), chars));
+}
+
+__attribute__((target("avx2")))
+static uint32_t blank_end_mask_32(__m256i chars)
+{
+    __m256i blank = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')),
+            _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\t'))),
+        _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\r')));
+    return ~(uint32_t)_mm256_movemask_epi8(blank);
+}
+
+__attribute__((target("avx2")))
+static uint32_t identifier_end_mask_32(__m256i chars)
+{
+    __m256i identifier = _mm256_or_si256(
+        _mm256_or_si256(in_range_32(chars, 'a', 'z'), in_range_32(chars, 'A', 'Z')),
+        _mm256_or_si256(in_range_32(chars, '0', '9'), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('_'))));
+    return ~(uint32_t)_mm256_movemask_epi8(identifier);
+}
+
+__attribute__((target("avx2")))
+static uint32_t string_end_mask_32(__m256i chars)
+{
+    __m256i end = _mm256_or_si256(
+        _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('"')),
+        _mm256_cmpeq_epi8(chars, _mm256_setzero_si256()));
+    return _mm256_movemask_epi8(end);
+}
+
+#define DEFINE_SCAN_32(name, end_mask)                                          \
+    __attribute__((target("avx2")))                                             \
+    static const char* name(const char* p)                                      \
+    {                                                                           \
+        const char* block = (const char*)((uintptr_t)p & ~(uintptr_t)31);     \
+        uint32_t mask = end_mask(_mm256_load_si256((const __m256i*)block)) >> (p - block); \
+        if (mask) return p + __builtin_ctz(mask);                               \
+        while (true)                                                            \
+        {                                                                       \
+            block += 32;                                                        \
+            mask = end_mask(_mm256_load_si256((const __m256i*)block));          \
+            if (mask) return block + __builtin_ctz(mask);                       \
+        }                                                                       \
+    }
+
+DEFINE_SCAN_32(skip_blanks_avx2, blank_end_mask_32)
+DEFINE_SCAN_32(skip_identifier_chars_avx2, identifier_end_mask_32)
+DEFINE_SCAN_32(find_string_end_avx2, string_end_mask_32)
+
+static const LexerScanKernels AVX2_KERNELS = {
+    skip_blanks_avx2,
+    skip_identifier_chars_avx2,
+    find_string_end_avx2,
+    "avx2",
+};
+
+static const LexerScanKernels& select_lexer_scan_kernels()
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) return AVX2_KERNELS;
+    if (__builtin_cpu_supports("sse2")) return SSE2_KERNELS;
+    return SCALAR_KERNELS;
+}
+
+#else
+
+static const LexerScanKernels& select_lexer_scan_kernels()
+{
+    return SCALAR_KERNELS;
+}
+
+#endif
+
+const LexerScanKernels& get_lexer_scan_kernels()
+{
+    static const LexerScanKernels& kernels = select_lexer_scan_kernels();
+    return kernels;
+}
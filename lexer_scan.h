@@ -0,0 +1,26 @@
+#pragma once
+
+// Kernels for skipping over runs of characters in the lexer.
+// Each takes a pointer into a NUL terminated buffer and returns a pointer to
+// the first byte at or after it which ends the run. NUL always ends a run.
+// Vector versions may read past the NUL up to the end of its aligned 16 or 32
+// byte block, which never crosses a page boundary.
+struct LexerScanKernels
+{
+    // Skips ' ', '\t' and '\r'. Newlines end the run so the lexer can count lines.
+    const char* (*skip_blanks)(const char* p);
+
+    // Skips [a-zA-Z0-9_]
+    const char* (*skip_identifier_chars)(const char* p);
+
+    // Finds the next '"'
+    const char* (*find_string_end)(const char* p);
+
+    const char* name;
+};
+
+// Picks the widest kernels this CPU supports. All of them produce identical results.
+const LexerScanKernels& get_lexer_scan_kernels();
+
+// Plain byte at a time kernels, always available
+const LexerScanKernels& get_scalar_lexer_scan_kernels();
@@ -0,0 +1,46 @@
+#include "link.h"
+
+#include <iostream>
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+// Runs argv[0] from the PATH and waits for it
+static bool run_tool(const char* const* argv, const char* output_path)
+{
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, (char* const*)argv, environ) != 0)
+    {
+        std::cerr << "Couldn't run " << argv[0] << std::endl;
+        return false;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        std::cerr << "Linking " << output_path << " failed" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool link_executable(const char* object_path, const char* executable_path)
+{
+    const char* argv[] = {"cc", object_path, "-o", executable_path, nullptr};
+    return run_tool(argv, executable_path);
+}
+
+bool combine_objects(const std::vector<std::string>& object_paths, const char* output_path)
+{
+    std::vector<const char*> argv = {"ld", "-r", "-o", output_path};
+    for (const std::string& path : object_paths)
+    {
+        argv.push_back(path.c_str());
+    }
+    argv.push_back(nullptr);
+
+    return run_tool(argv.data(), output_path);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Links an object file into an executable with the system C compiler driver,
+// which knows where libc and its startup files are.
+// Returns false if the linker couldn't be run or failed.
+bool link_executable(const char* object_path, const char* executable_path);
+
+// Combines object files into one relocatable object file with the system linker.
+bool combine_objects(const std::vector<std::string>& object_paths, const char* output_path);
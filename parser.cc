@@ -6,6 +6,10 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 const char* AST_NODE_TYPE_NAME[] = {
     [ASTNodeType::Invalid] = "Invalid",
@@ -34,243 +38,519 @@ uint8_t OPERATOR_PRECEDENCE[TokenType::Count] = {
     ['>'] = 5,
 };
 
+// The parser never looks more than this many tokens ahead (in parse_def),
+// or more than one token back.
+constexpr uint32_t MAX_LOOKAHEAD = 3;
+
+// Enough for the lookahead and lookbehind, rounded up to a power of 2
+constexpr uint32_t TOKEN_WINDOW_SIZE = 8;
+static_assert(MAX_LOOKAHEAD + 2 <= TOKEN_WINDOW_SIZE, "Token window doesn't cover parser lookahead");
+
+// Parsing function bodies on more threads isn't worth it for fewer bodies than this
+constexpr uint32_t MIN_BODIES_PER_WORKER = 64;
+
 struct TokenReader {
-    Token const * data = nullptr;
-    uint32_t length = 0;
+    const TokenStream* stream = nullptr;
     uint32_t position = 0;
 
-    Token peek(int32_t index = 0)
+    // If set, tokens are lexed into stream as they are peeked at
+    Lexer* lexer = nullptr;
+
+    // Returns false if token is past the end of the file
+    bool fill(uint32_t token)
+    {
+        while (token >= stream->size())
+        {
+            if (!lexer || !lexer->lex_token())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Type of the token index tokens ahead, or Invalid past the end
+    uint32_t peek(int32_t index = 0)
     {
-        if ((int32_t)position + index >= (int32_t)length)
+        assert(index <= (int32_t)MAX_LOOKAHEAD);
+
+        if (!fill(position + index))
         {
-            return {};
+            return TokenType::Invalid;
         }
 
-        return data[position + index];
+        return stream->type(position + index);
+    }
+
+    SubString peek_str(int32_t index = 0) const
+    {
+        return stream->str(position + index);
+    }
+
+    uint32_t peek_name_id(int32_t index = 0) const
+    {
+        return stream->name_id(position + index);
+    }
+
+    uint64_t peek_number_value(int32_t index = 0) const
+    {
+        return stream->number_value(position + index);
+    }
+
+    uint32_t peek_type_id(int32_t index = 0) const
+    {
+        return stream->type_id(position + index);
     }
 
     void advance(uint32_t amount = 1)
     {
-        assert(position + amount <= length);
+        fill(position + amount - 1);
+        assert(position + amount <= stream->size());
         position += amount;
     }
 
     bool eof()
     {
-        return position >= length;
+        return !fill(position);
     }
 };
 
-ASTNode* AST::push_orphan(const ASTNode& node)
+static void assert_at_token(bool condition, const char* err_msg, const TokenReader& tokens, int32_t index = 0)
+{
+    assert_at_token(condition, err_msg, *tokens.stream, tokens.position + index);
+}
+
+static void fail_at_token(const char* err_msg, const TokenReader& tokens, int32_t index = 0)
 {
-    uint32_t align;
-    uint32_t size;
-    switch (node.type)
+    assert_at_token(false, err_msg, tokens, index);
+}
+
+AST::AST()
+{
+    plain_nodes.emplace_back();
+}
+
+ASTNode* AST::node(NodeRef ref)
+{
+    uint32_t index = ref & NODE_INDEX_MASK;
+    switch (ref >> NODE_POOL_SHIFT)
     {
-        case ASTNodeType::ParameterList:
-        case ASTNodeType::Return:
-        case ASTNodeType::If:
-        case ASTNodeType::While:
-        case ASTNodeType::FunctionCall:
-            align = alignof(ASTNode);
-            size = sizeof(ASTNode);
-            break;
-        case ASTNodeType::BinaryOperator:
-            align = alignof(ASTBinOpNode);
-            size = sizeof(ASTBinOpNode);
-            break;
-        case ASTNodeType::FunctionDef:
-        case ASTNodeType::FunctionParameter:
-        case ASTNodeType::VariableDef:
-        case ASTNodeType::Assignment:
-        case ASTNodeType::Identifier:
-            align = alignof(ASTIdentifierNode);
-            size = sizeof(ASTIdentifierNode);
-            break;
-        case ASTNodeType::Number:
-            align = alignof(ASTNumberNode);
-            size = sizeof(ASTNumberNode);
-            break;
-        case ASTNodeType::StatementList:
-            align = alignof(ASTStatementListNode);
-            size = sizeof(ASTStatementListNode);
-            break;
-        case ASTNodeType::String:
-            align = alignof(ASTStringNode);
-            size = sizeof(ASTStringNode);
-            break;
+        case ASTPool::Plain:
+            return ref == NO_NODE ? nullptr : &plain_nodes[index];
+        case ASTPool::BinOp:
+            return &binop_nodes[index];
+        case ASTPool::Number:
+            return &number_nodes[index];
+        case ASTPool::Identifier:
+            return &identifier_nodes[index];
+        case ASTPool::String:
+            return &string_nodes[index];
+        case ASTPool::StatementList:
+            return &statement_list_nodes[index];
         default:
-            assert(false && "Unknown node size");
+            assert(false && "Invalid node pool");
+            return nullptr;
     }
+}
 
-    // Get alignment right
-    next += (align - (next % align)) % align;
-    ASTNode* result = (ASTNode*)(data + next);
-
-    assert(next + size <= MAX_SIZE);
+template <typename T>
+static NodeRef push_to_pool(std::vector<T>& pool, uint32_t pool_id, const T& node)
+{
+    assert(pool.size() <= NODE_INDEX_MASK && "Too many AST nodes");
 
-    memcpy(result, &node, size);
-    next += size;
+    NodeRef result = (pool_id << NODE_POOL_SHIFT) | (uint32_t)pool.size();
+    pool.push_back(node);
 
     return result;
 }
 
-void AST::attach(ASTNode* node)
+NodeRef AST::push_orphan(const ASTNode& node)
 {
-    *next_node_ref = node;
-    next_node_ref = &node->sibling;
+    return push_to_pool(plain_nodes, ASTPool::Plain, node);
 }
 
-ASTNode* AST::push(const ASTNode& node)
+NodeRef AST::push_orphan(const ASTBinOpNode& node)
 {
-    ASTNode* result = push_orphan(node);
-    attach(result);
+    return push_to_pool(binop_nodes, ASTPool::BinOp, node);
+}
 
-    return result;
+NodeRef AST::push_orphan(const ASTNumberNode& node)
+{
+    return push_to_pool(number_nodes, ASTPool::Number, node);
+}
+
+NodeRef AST::push_orphan(const ASTIdentifierNode& node)
+{
+    return push_to_pool(identifier_nodes, ASTPool::Identifier, node);
+}
+
+NodeRef AST::push_orphan(const ASTStringNode& node)
+{
+    return push_to_pool(string_nodes, ASTPool::String, node);
+}
+
+NodeRef AST::push_orphan(const ASTStatementListNode& node)
+{
+    return push_to_pool(statement_list_nodes, ASTPool::StatementList, node);
+}
+
+void AST::attach(NodeRef ref)
+{
+    if (attach_owner == NO_NODE)
+    {
+        start = ref;
+    }
+    else if (attach_as_child)
+    {
+        node(attach_owner)->child = ref;
+    }
+    else
+    {
+        node(attach_owner)->sibling = ref;
+    }
+
+    attach_owner = ref;
+    attach_as_child = false;
+}
+
+void AST::begin_children(NodeRef ref)
+{
+    attach_owner = ref;
+    attach_as_child = true;
+}
+
+void AST::end_children(NodeRef ref)
+{
+    attach_owner = ref;
+    attach_as_child = false;
 }
 
-void AST::begin_children(ASTNode* node)
+void AST::reset()
 {
-    next_node_ref = &node->child;
+    plain_nodes.resize(1);
+    binop_nodes.clear();
+    number_nodes.clear();
+    identifier_nodes.clear();
+    string_nodes.clear();
+    statement_list_nodes.clear();
+
+    start = NO_NODE;
+    attach_owner = NO_NODE;
+    attach_as_child = false;
+    arena.reset();
 }
 
-void AST::end_children(ASTNode* node)
+uint64_t AST::node_bytes() const
 {
-    next_node_ref = &node->sibling;
+    return plain_nodes.size() * sizeof(ASTNode)
+        + binop_nodes.size() * sizeof(ASTBinOpNode)
+        + number_nodes.size() * sizeof(ASTNumberNode)
+        + identifier_nodes.size() * sizeof(ASTIdentifierNode)
+        + string_nodes.size() * sizeof(ASTStringNode)
+        + statement_list_nodes.size() * sizeof(ASTStatementListNode);
 }
 
-SymbolData* Scope::lookup_symbol(SubString name)
+void Scope::init(Arena& arena_, Scope* parent_)
 {
-    for (uint32_t i = 0; i < symbols.length; ++i)
+    arena = &arena_;
+    parent = parent_;
+    table = nullptr;
+    capacity = 0;
+    count = 0;
+    parent_visible_count = UINT32_MAX;
+}
+
+// Ids are dense, so they need mixing to spread out over the table
+static uint32_t name_id_hash(uint32_t name_id)
+{
+    uint32_t hash = name_id * 2654435769u;
+    return hash ^ (hash >> 16);
+}
+
+SymbolData* Scope::lookup_local(uint32_t name_id)
+{
+    if (!count)
+    {
+        return nullptr;
+    }
+
+    uint32_t mask = capacity - 1;
+    for (uint32_t i = name_id_hash(name_id) & mask; table[i].symbol; i = (i + 1) & mask)
     {
-        if (symbols[i].name == name)
+        if (table[i].name_id == name_id)
         {
-            return &symbols[i];
+            return table[i].symbol;
         }
     }
+    return nullptr;
+}
 
-    // Symbol wasn't found in the current scope, so search the parent scope
-    if (parent)
+SymbolData* Scope::lookup_symbol(uint32_t name_id)
+{
+    // If the symbol isn't found in the current scope, search the parent scope
+    uint32_t visible_count = UINT32_MAX;
+    for (Scope* scope = this; scope; scope = scope->parent)
     {
-        return parent->lookup_symbol(name);
+        SymbolData* symbol = scope->lookup_local(name_id);
+        if (symbol && symbol->declaration_index < visible_count)
+        {
+            return symbol;
+        }
+        visible_count = scope->parent_visible_count;
     }
     return nullptr;
 }
 
-SymbolData* Scope::push(SubString name, uint32_t type_id)
+void Scope::grow()
+{
+    Entry* old_table = table;
+    uint32_t old_capacity = capacity;
+
+    capacity = capacity ? capacity * 2 : 8;
+    table = arena->alloc_array<Entry>(capacity);
+
+    uint32_t mask = capacity - 1;
+    for (uint32_t i = 0; i < old_capacity; ++i)
+    {
+        if (!old_table[i].symbol) continue;
+
+        uint32_t slot = name_id_hash(old_table[i].name_id) & mask;
+        while (table[slot].symbol)
+        {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = old_table[i];
+    }
+    // The old table stays in the arena until it's reset
+}
+
+SymbolData* Scope::push(uint32_t name_id, uint32_t type_id)
 {
-    SymbolData new_symbol;
-    new_symbol.name = name;
-    new_symbol.type_id = type_id;
-    symbols.push(new_symbol);
+    // Keep the load factor at most 1/2
+    if (2 * (count + 1) > capacity)
+    {
+        grow();
+    }
+
+    SymbolData* new_symbol = arena->alloc_array<SymbolData>(1);
+    new_symbol->name_id = name_id;
+    new_symbol->name = interner_g.get(name_id);
+    new_symbol->type_id = type_id;
+    new_symbol->declaration_index = count;
 
-    return symbols.back();
+    uint32_t mask = capacity - 1;
+    uint32_t slot = name_id_hash(name_id) & mask;
+    while (table[slot].symbol)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    table[slot].name_id = name_id;
+    table[slot].symbol = new_symbol;
+    ++count;
+
+    return new_symbol;
 }
 
 // ----------------------------
 // Functions for generating AST
 // ----------------------------
 
-static void parse_def(TokenReader& tokens, AST& ast, Scope& scope);
+static void parse_def(TokenReader& tokens, AST& ast, Scope& scope, std::vector<DeferredBody>* deferred_bodies = nullptr);
 static void parse_statement_list(TokenReader& tokens, AST& ast, Scope& scope);
 
-// Creates a subexpression consisting of operators of precedence >= precedence,
-// starting at the initial position of the token reader.
-// Returns the subexpression once the token reader has advanced onto a lower
-// precedence operator.
-static ASTNode* parse_expression(TokenReader& tokens, AST& ast, Scope& scope, uint32_t precedence)
+// Operator precedence parsing with explicit stacks instead of recursion, so
+// long operator chains and deep nesting use constant native stack.
+//
+// Each open parenthesis, either grouping or a call's argument list, pushes a
+// frame. Binary operators wait on the operator stack until an operator of
+// lower or equal precedence (or the end of their frame) shows up, which makes
+// them left associative.
+
+namespace ExprFrameType
 {
-    // Stick a subexpression on the AST, then advance onto an operator or terminator.
-    ASTNode* result;
-    if (tokens.peek().type == '(')
+    enum
     {
-        tokens.advance();
+        Top,
+        Group,          // ( expression )
+        CallArgs,       // callee(arg, ...)
+    };
+}
 
-        result = parse_expression(tokens, ast, scope, 1);
+struct ExprFrame
+{
+    uint32_t type;
+    uint32_t op_base;   // Height of the operator stack when the frame was opened
+    NodeRef callee;     // For CallArgs
+    NodeRef last_arg;   // For CallArgs, the callee if there are no arguments yet
+};
 
-        assert_at_token(tokens.peek().type == ')', "Missing ')'", tokens.peek());
+struct PendingOp
+{
+    NodeRef lhs;
+    uint32_t op;
+    uint32_t precedence;
+};
 
-        tokens.advance();      // move past ')'
-    }
-    else if (tokens.peek().type == TokenType::String)
-    {
-        result = ast.push_orphan(ASTStringNode(tokens.peek().str));
-        tokens.advance();
-    }
-    else if (tokens.peek().type == TokenType::Name)
+// Kept between calls to avoid allocating for every expression
+static thread_local std::vector<ExprFrame> expr_frames;
+static thread_local std::vector<PendingOp> pending_ops;
+
+// Builds binary operator nodes for the pending operators above op_base
+// with precedence >= precedence, with operand as the rightmost operand.
+static NodeRef reduce_ops(AST& ast, std::vector<PendingOp>& ops, uint32_t op_base, NodeRef operand, uint32_t precedence)
+{
+    while (ops.size() > op_base && ops.back().precedence >= precedence)
     {
-        SymbolData* symbol = scope.lookup_symbol(tokens.peek().str);
-        assert_at_token(symbol, "Unknown identifier", tokens.peek());
+        PendingOp pending = ops.back();
+        ops.pop_back();
 
-        result = ast.push_orphan(ASTIdentifierNode(ASTNodeType::Identifier, symbol));
+        ast.node(pending.lhs)->sibling = operand;
 
-        tokens.advance();
-    }
-    else if (tokens.peek().type == TokenType::Number)
-    {
-        result = ast.push_orphan(ASTNumberNode(tokens.peek().number_value));
+        NodeRef op_node = ast.push_orphan(ASTBinOpNode(pending.op));
+        ast.node(op_node)->child = pending.lhs;
 
-        tokens.advance();
-    }
-    else
-    {
-        fail_at_token("Expected a subexpression", tokens.peek());
+        operand = op_node;
     }
+    return operand;
+}
 
-    // Now we are sitting on an operator or terminator.
+// Parses an expression starting at the current token, and returns it once the
+// token reader is sitting on a terminator (a token which isn't an operator).
+// The caller must make sure that the terminator is valid.
+static NodeRef parse_expression(TokenReader& tokens, AST& ast, Scope& scope)
+{
+    std::vector<ExprFrame>& frames = expr_frames;
+    std::vector<PendingOp>& ops = pending_ops;
 
-    uint32_t op_type = tokens.peek().type;
-    uint32_t op_precedence = OPERATOR_PRECEDENCE[op_type];
-    while (op_precedence >= precedence)
-    {
-        // Result is the lhs of the current operator.
-        // Now build rhs.
+    frames.clear();
+    ops.clear();
 
-        tokens.advance();
+    ExprFrame top = {};
+    top.type = ExprFrameType::Top;
+    frames.push_back(top);
 
-        if (op_type == '(')
+    while (true)
+    {
+        // Stick a subexpression on the AST, then advance onto an operator or terminator.
+        if (tokens.peek() == '(')
         {
-            // This is a function call
+            tokens.advance();
 
-            ASTNode* arg = result;
-            while (tokens.peek().type != ')')
-            {
-                arg->sibling = parse_expression(tokens, ast, scope, 1);
-                assert_at_token(tokens.peek().type == ',' || tokens.peek().type == ')', "Expected ',' or ')'", tokens.peek());
+            ExprFrame group = {};
+            group.type = ExprFrameType::Group;
+            group.op_base = ops.size();
+            frames.push_back(group);
+            continue;
+        }
 
-                arg = arg->sibling;
-            }
+        NodeRef operand = NO_NODE;
+        if (tokens.peek() == TokenType::String)
+        {
+            operand = ast.push_orphan(ASTStringNode(tokens.peek_str()));
+            tokens.advance();
+        }
+        else if (tokens.peek() == TokenType::Name)
+        {
+            SymbolData* symbol = scope.lookup_symbol(tokens.peek_name_id());
+            assert_at_token(symbol, "Unknown identifier", tokens);
+
+            operand = ast.push_orphan(ASTIdentifierNode(ASTNodeType::Identifier, symbol));
 
-            // Advance past ')'
             tokens.advance();
+        }
+        else if (tokens.peek() == TokenType::Number)
+        {
+            operand = ast.push_orphan(ASTNumberNode(tokens.peek_number_value()));
 
-            ASTNode* function_call_node = ast.push_orphan(ASTNode(ASTNodeType::FunctionCall));
-            function_call_node->child = result;
-            result = function_call_node;
+            tokens.advance();
         }
         else
         {
-            // Construct rhs expression
-            result->sibling = parse_expression(tokens, ast, scope, op_precedence + 1);
+            fail_at_token("Expected a subexpression", tokens);
+        }
 
-            ASTNode* op_node = ast.push_orphan(ASTBinOpNode(op_type));
-            op_node->child = result;
+        // Now we are sitting on an operator or terminator. Keep going until
+        // there is another subexpression to parse.
+        while (true)
+        {
+            uint32_t op_type = tokens.peek();
+            uint32_t op_precedence = OPERATOR_PRECEDENCE[op_type];
 
-            result = op_node;
-        }
+            operand = reduce_ops(ast, ops, frames.back().op_base, operand, op_precedence);
 
-        // We should now be sitting after an op_precedence + 1 subexpression
-        assert(OPERATOR_PRECEDENCE[tokens.peek().type] <= op_precedence);
+            if (op_type == '(')
+            {
+                // This is a function call, which binds tighter than any binary operator.
+                // Type checking, codegen and lazy parsing all take the callee to be a name.
+                assert_at_token(ast.node(operand)->type == ASTNodeType::Identifier, "Expected a function name before '('", tokens);
+                tokens.advance();
+
+                ExprFrame call = {};
+                call.type = ExprFrameType::CallArgs;
+                call.op_base = ops.size();
+                call.callee = operand;
+                call.last_arg = operand;
+                frames.push_back(call);
+
+                if (tokens.peek() != ')')
+                {
+                    break;  // Parse the first argument
+                }
+            }
+            else if (op_precedence)
+            {
+                // Binary operator, the rhs comes next
+                tokens.advance();
+
+                PendingOp pending;
+                pending.lhs = operand;
+                pending.op = op_type;
+                pending.precedence = op_precedence;
+                ops.push_back(pending);
+                break;
+            }
+            else
+            {
+                // Terminator, so the innermost frame is finished
+                ExprFrame& frame = frames.back();
+                if (frame.type == ExprFrameType::Top)
+                {
+                    assert(ops.empty());
+                    return operand;
+                }
+                else if (frame.type == ExprFrameType::Group)
+                {
+                    assert_at_token(tokens.peek() == ')', "Missing ')'", tokens);
+                    tokens.advance();      // move past ')'
+
+                    frames.pop_back();
+                    continue;
+                }
+
+                assert_at_token(tokens.peek() == ',' || tokens.peek() == ')', "Expected ',' or ')'", tokens);
+                ast.node(frame.last_arg)->sibling = operand;
+                frame.last_arg = operand;
+
+                if (tokens.peek() != ')')
+                {
+                    tokens.advance();   // move past ','
+                    break;  // Parse the next argument
+                }
+            }
 
-        op_type = tokens.peek().type;
-        op_precedence = OPERATOR_PRECEDENCE[op_type];
-    }
+            // Finish the call, the frame is sitting on its ')'
+            ExprFrame call = frames.back();
+            frames.pop_back();
+            assert(call.type == ExprFrameType::CallArgs);
 
-    // Subexpression is terminated, either with a lower precedence operator
-    // or a terminator character. If subexpression has ended on a terminator,
-    // the caller must make sure that the terminator is valid.
+            tokens.advance();
 
-    return result;
+            NodeRef function_call_node = ast.push_orphan(ASTNode(ASTNodeType::FunctionCall));
+            ast.node(function_call_node)->child = call.callee;
+            operand = function_call_node;
+        }
+    }
 }
 
 static void parse_if_or_while(TokenReader& tokens, AST& ast, Scope& scope)
@@ -279,12 +559,12 @@ static void parse_if_or_while(TokenReader& tokens, AST& ast, Scope& scope)
     bool is_if = false;
 
     uint32_t statement_node_type;
-    if (tokens.peek().type == TokenType::If)
+    if (tokens.peek() == TokenType::If)
     {
         statement_node_type = ASTNodeType::If;
         is_if = true;
     }
-    else if (tokens.peek().type == TokenType::While)
+    else if (tokens.peek() == TokenType::While)
     {
         statement_node_type = ASTNodeType::While;
     }
@@ -293,21 +573,21 @@ static void parse_if_or_while(TokenReader& tokens, AST& ast, Scope& scope)
         assert(false);
     }
 
-    ASTNode* statement_node = ast.push(statement_node_type);
+    NodeRef statement_node = ast.push(ASTNode(statement_node_type));
     ast.begin_children(statement_node);
 
     tokens.advance();
 
-    ASTNode* condition_node = parse_expression(tokens, ast, scope, 1);
+    NodeRef condition_node = parse_expression(tokens, ast, scope);
     ast.attach(condition_node);
 
-    assert_at_token(tokens.peek().type == '{', "Expected block following if", tokens.peek());
+    assert_at_token(tokens.peek() == '{', "Expected block following if", tokens);
     parse_statement_list(tokens, ast, scope);
 
     if (is_if)
     {
         // check for else
-        if (tokens.peek().type == TokenType::Else)
+        if (tokens.peek() == TokenType::Else)
         {
             tokens.advance();
             parse_statement_list(tokens, ast, scope);
@@ -319,219 +599,255 @@ static void parse_if_or_while(TokenReader& tokens, AST& ast, Scope& scope)
 
 static void parse_statement(TokenReader& tokens, AST& ast, Scope& scope)
 {
-    if (tokens.peek().type == TokenType::Name && tokens.peek(1).type == ':')
+    if (tokens.peek() == TokenType::Name && tokens.peek(1) == ':')
     {
-        // Parse definition
+        // Parse definition. Only top-level functions are generated.
+        assert_at_token(tokens.peek(2) != '(', "Nested functions aren't supported", tokens);
         parse_def(tokens, ast, scope);
     }
-    else if (tokens.peek().type == TokenType::Name && tokens.peek(1).type == '=')
+    else if (tokens.peek() == TokenType::Name && tokens.peek(1) == '=')
     {
         // Parse assignment
-        SymbolData* symbol = scope.lookup_symbol(tokens.peek().str);
-        assert_at_token(symbol, "Unknown symbol", tokens.peek());
+        SymbolData* symbol = scope.lookup_symbol(tokens.peek_name_id());
+        assert_at_token(symbol, "Unknown symbol", tokens);
 
-        ASTNode* assign_node = ast.push(ASTIdentifierNode(ASTNodeType::Assignment, symbol));
+        NodeRef assign_node = ast.push(ASTIdentifierNode(ASTNodeType::Assignment, symbol));
 
         tokens.advance(2);
 
-        assign_node->child = parse_expression(tokens, ast, scope, 1);
-        assert_at_token(tokens.peek().type == ';', "Expected ';'", tokens.peek());
+        NodeRef value_node = parse_expression(tokens, ast, scope);
+        ast.node(assign_node)->child = value_node;
+        assert_at_token(tokens.peek() == ';', "Expected ';'", tokens);
 
         tokens.advance();  // advance past semicolon
     }
-    else if (tokens.peek().type == TokenType::Return)
+    else if (tokens.peek() == TokenType::Return)
     {
-        ASTNode* return_node = ast.push(ASTNode(ASTNodeType::Return));
+        NodeRef return_node = ast.push(ASTNode(ASTNodeType::Return));
         tokens.advance();
 
-        if (tokens.peek().type == ';')
+        if (tokens.peek() == ';')
         {
             tokens.advance();  // advance past semicolon
         }
         else
         {
             // Returning an expression
-            return_node->child = parse_expression(tokens, ast, scope, 1);
-            assert_at_token(tokens.peek().type == ';', "Expected ';'", tokens.peek());
+            NodeRef value_node = parse_expression(tokens, ast, scope);
+            ast.node(return_node)->child = value_node;
+            assert_at_token(tokens.peek() == ';', "Expected ';'", tokens);
 
             tokens.advance();  // advance past semicolon
         }
     }
-    else if (tokens.peek().type == TokenType::If || tokens.peek().type == TokenType::While)
+    else if (tokens.peek() == TokenType::If || tokens.peek() == TokenType::While)
     {
         parse_if_or_while(tokens, ast, scope);
     }
     else
     {
         // Assume this is an expression (e.g. function call)
-        ast.attach(parse_expression(tokens, ast, scope, 1));
-        assert_at_token(tokens.peek().type == ';', "Expected ';'", tokens.peek());
+        ast.attach(parse_expression(tokens, ast, scope));
+        assert_at_token(tokens.peek() == ';', "Expected ';'", tokens);
         tokens.advance();  // advance past semicolon
     }
 }
 
-static void parse_parameter_list(TokenReader& tokens, AST& ast, Scope& scope, SymbolData* function_symbol)
+// Appends the parameter types to param_types
+static void parse_parameter_list(TokenReader& tokens, AST& ast, Scope& scope, std::vector<uint32_t>& param_types)
 {
-    assert_at_token(tokens.peek().type == '(', "Expected '('", tokens.peek());
+    assert_at_token(tokens.peek() == '(', "Expected '('", tokens);
 
-    ASTNode* parameter_list_node = ast.push(ASTNode(ASTNodeType::ParameterList));
+    NodeRef parameter_list_node = ast.push(ASTNode(ASTNodeType::ParameterList));
 
     ast.begin_children(parameter_list_node);
 
-    uint32_t param_count = 0;
-
-    if (tokens.peek(1).type != ')')
+    if (tokens.peek(1) != ')')
     {
         do
         {
             tokens.advance();
 
-            assert_at_token(tokens.peek().type == TokenType::Name, "Expected an identifier", tokens.peek());
-            assert_at_token(tokens.peek(1).type == ':', "Expected ':'", tokens.peek(1));
-            assert_at_token(tokens.peek(2).type == TokenType::TypeName, "Expected a type", tokens.peek(2));
+            assert_at_token(tokens.peek() == TokenType::Name, "Expected an identifier", tokens);
+            assert_at_token(tokens.peek(1) == ':', "Expected ':'", tokens, 1);
+            assert_at_token(tokens.peek(2) == TokenType::TypeName, "Expected a type", tokens, 2);
 
-            SymbolData* new_symbol = scope.push(tokens.peek().str, tokens.peek(2).type_id);
+            SymbolData* new_symbol = scope.push(tokens.peek_name_id(), tokens.peek_type_id(2));
 
             ast.push(ASTIdentifierNode(ASTNodeType::FunctionParameter, new_symbol));
 
-            ++param_count;
+            param_types.push_back(new_symbol->type_id);
 
             tokens.advance(3);
-        } while(tokens.peek().type == ',');
+        } while(tokens.peek() == ',');
     }
     else
     {
         tokens.advance();
     }
 
-    assert_at_token(tokens.peek().type == ')', "Expected ')'", tokens.peek());
+    assert_at_token(tokens.peek() == ')', "Expected ')'", tokens);
     tokens.advance();
 
     ast.end_children(parameter_list_node);
-
-    // Add parameter types to function info
-    function_symbol->function_info = (FunctionInfo*) new char[sizeof(FunctionInfo) + 4 * param_count];
-    function_symbol->function_info->param_count = param_count;
-
-    ASTNode* param = (ASTIdentifierNode*)parameter_list_node->child;
-    for (size_t i = 0; i < param_count; ++i, param = param->sibling)
-    {
-        assert(param);
-        assert(param->type == ASTNodeType::FunctionParameter);
-        function_symbol->function_info->param_types[i] = static_cast<ASTIdentifierNode*>(param)->symbol->type_id;
-    }
-    assert(!param);
 }
 
 static void parse_statement_list(TokenReader& tokens, AST& ast, Scope& scope)
 {
-    assert_at_token(tokens.peek().type == '{', "Expected '{'", tokens.peek());
+    assert_at_token(tokens.peek() == '{', "Expected '{'", tokens);
     tokens.advance();
 
-    ASTNode* statement_list_node = ast.push(ASTStatementListNode(scope));
+    Scope* statement_list_scope = ast.arena.alloc_array<Scope>(1);
+    statement_list_scope->init(ast.arena, &scope);
+
+    ASTStatementListNode statement_list;
+    statement_list.scope = statement_list_scope;
+    NodeRef statement_list_node = ast.push(statement_list);
 
     ast.begin_children(statement_list_node);
 
-    while (!tokens.eof() && tokens.peek().type != '}')
+    while (!tokens.eof() && tokens.peek() != '}')
     {
-        parse_statement(tokens, ast, static_cast<ASTStatementListNode*>(statement_list_node)->scope);
+        parse_statement(tokens, ast, *statement_list_scope);
     }
 
     ast.end_children(statement_list_node);
 
-    assert_at_token(!tokens.eof(), "Expected '}'", tokens.peek(-1));
+    assert_at_token(!tokens.eof(), "Expected '}'", tokens, -1);
     tokens.advance();
 }
 
-static void parse_def(TokenReader& tokens, AST& ast, Scope& scope)
+// Moves past a statement list by matching braces, without parsing it.
+// The tokens must all be lexed already.
+static void skip_statement_list(TokenReader& tokens)
+{
+    assert(!tokens.lexer);
+    assert_at_token(tokens.peek() == '{', "Expected '{'", tokens);
+
+    const TokenStream& stream = *tokens.stream;
+    uint32_t depth = 0;
+    uint32_t i = tokens.position;
+    for (; i < stream.size(); ++i)
+    {
+        uint32_t type = stream.type(i);
+        if (type == '{')
+        {
+            ++depth;
+        }
+        else if (type == '}' && --depth == 0)
+        {
+            break;
+        }
+    }
+
+    // A missing '}' is reported when the body is parsed
+    tokens.position = std::min(i + 1, stream.size());
+}
+
+static void parse_def(TokenReader& tokens, AST& ast, Scope& scope, std::vector<DeferredBody>* deferred_bodies)
 {
 
     assert_at_token(
-        tokens.peek().type == TokenType::Name && tokens.peek(1).type == ':',
+        tokens.peek() == TokenType::Name && tokens.peek(1) == ':',
         "Invalid definition",
-        tokens.peek());
+        tokens);
 
     // check if an entry is already in the symbol table
-    assert_at_token(!scope.lookup_symbol(tokens.peek().str), "Symbol already declared", tokens.peek());
+    assert_at_token(!scope.lookup_symbol(tokens.peek_name_id()), "Symbol already declared", tokens);
 
     // figure out which type of def:
-    if (tokens.peek(2).type == '(')
+    if (tokens.peek(2) == '(')
     {
         // this is a function def
 
-        SymbolData* new_symbol = scope.push(tokens.peek().str, TypeId::Invalid);
+        SymbolData* new_symbol = scope.push(tokens.peek_name_id(), TypeId::Invalid);
 
-        ASTNode* function_identifier_node = ast.push(ASTIdentifierNode(ASTNodeType::FunctionDef, new_symbol));
+        NodeRef function_identifier_node = ast.push(ASTIdentifierNode(ASTNodeType::FunctionDef, new_symbol));
 
         ast.begin_children(function_identifier_node);
 
-        // Need to make the function's symbol table here so we can add the parameters to the scope
-        Scope function_scope;
-        function_scope.parent = &scope;
-        function_scope.symbols.max_length = MAX_SYMBOLS;
-        function_scope.symbols.data = new SymbolData[MAX_SYMBOLS];
+        // Need to make the function's symbol table here so we can add the parameters to the scope.
+        // It's the parent of the body's scope, so it has to outlive this function.
+        Scope* function_scope = ast.arena.alloc_array<Scope>(1);
+        function_scope->init(ast.arena, &scope);
+        function_scope->parent_visible_count = scope.count;
 
         tokens.advance(2);
 
-        parse_parameter_list(tokens, ast, function_scope, new_symbol);
+        // The signature is interned before the body is parsed, so nested definitions can reuse this
+        thread_local std::vector<uint32_t> param_types;
+        param_types.clear();
+
+        parse_parameter_list(tokens, ast, *function_scope, param_types);
 
-        if (tokens.peek().type == '-' && tokens.peek(1).type == '>')
+        uint32_t return_type = TypeId::None;
+        if (tokens.peek() == '-' && tokens.peek(1) == '>')
         {
             assert_at_token(
-                tokens.peek(2).type == TokenType::TypeName,
+                tokens.peek(2) == TokenType::TypeName,
                 "Expected type name",
-                tokens.peek(2));
+                tokens, 2);
 
-            new_symbol->function_info->return_type = tokens.peek(2).type_id;
+            return_type = tokens.peek_type_id(2);
 
             tokens.advance(3);
         }
-        else
-        {
-            new_symbol->function_info->return_type = TypeId::None;
-        }
 
-        if (tokens.peek().type == ';')
+        new_symbol->type_id = type_table_g.function(return_type, param_types.data(), param_types.size());
+
+        if (tokens.peek() == ';')
         {
             // This is just a declaration, skip past semicolon
             tokens.advance();
         }
+        else if (deferred_bodies)
+        {
+            DeferredBody body;
+            body.function_node = function_identifier_node;
+            body.scope = function_scope;
+            body.start = tokens.position;
+            deferred_bodies->push_back(body);
+
+            skip_statement_list(tokens);
+        }
         else
         {
-            parse_statement_list(tokens, ast, function_scope);
+            parse_statement_list(tokens, ast, *function_scope);
         }
 
         ast.end_children(function_identifier_node);
     }
-    else if (tokens.peek(2).type == '=')
+    else if (tokens.peek(2) == '=')
     {
         assert(false && "type inference not yet supported");
     }
-    else if (tokens.peek(2).type == TokenType::TypeName
-             && tokens.peek(3).type == '=') // This is a variable def
+    else if (tokens.peek(2) == TokenType::TypeName
+             && tokens.peek(3) == '=') // This is a variable def
     {
         // the symbol has to be set later because it's not in the scope yet
-        ASTNode* variable_def_node = ast.push(ASTIdentifierNode(ASTNodeType::VariableDef, nullptr));
+        NodeRef variable_def_node = ast.push(ASTIdentifierNode(ASTNodeType::VariableDef, nullptr));
 
-        SubString variable_name = tokens.peek().str;
-        uint32_t variable_type = tokens.peek(2).type_id;
+        uint32_t variable_name_id = tokens.peek_name_id();
+        uint32_t variable_type = tokens.peek_type_id(2);
 
         tokens.advance(4);
 
-        variable_def_node->child = parse_expression(tokens, ast, scope, 1);
+        NodeRef value_node = parse_expression(tokens, ast, scope);
 
         // symbol is set here
-        static_cast<ASTIdentifierNode*>(variable_def_node)->symbol = scope.push(variable_name, variable_type);
+        ASTIdentifierNode* variable_def = static_cast<ASTIdentifierNode*>(ast.node(variable_def_node));
+        variable_def->child = value_node;
+        variable_def->symbol = scope.push(variable_name_id, variable_type);
 
         tokens.advance();      // advance past semicolon
     }
     else
     {
-        fail_at_token("Invalid definition", tokens.peek());
+        fail_at_token("Invalid definition", tokens);
     }
 }
 
-static void print_ast_node(ASTNode* node, Scope& scope, uint32_t depth)
+static void print_ast_node(AST& ast, ASTNode* node, uint32_t depth)
 {
 
     for (uint32_t i = 0; i < depth; ++i)
@@ -569,39 +885,267 @@ static void print_ast_node(ASTNode* node, Scope& scope, uint32_t depth)
         std::cout << AST_NODE_TYPE_NAME[node->type] << std::endl;
     }
 
-    if (node->type == ASTNodeType::StatementList)
-    {
-        scope = static_cast<ASTStatementListNode*>(node)->scope;
-    }
-
-    ASTNode* child = node->child;
+    ASTNode* child = ast.child(node);
     while (child)
     {
-        print_ast_node(child, scope, depth + 1);
-        child = child->sibling;
+        print_ast_node(ast, child, depth + 1);
+        child = ast.sibling(child);
     }
 }
 
-void parse(const std::vector<Token>& tokens, AST& ast, Scope& global_scope)
+static void parse_top_level(TokenReader& token_reader, AST& ast, Scope& global_scope, std::vector<DeferredBody>* deferred_bodies)
 {
-    TokenReader token_reader;
-    token_reader.data = tokens.data();
-    token_reader.length = tokens.size();
-
     while (!token_reader.eof())
     {
         // top level expressions
-        switch (token_reader.peek().type)
+        switch (token_reader.peek())
         {
             case TokenType::Name: {
-                parse_def(token_reader, ast, global_scope);
+                parse_def(token_reader, ast, global_scope, deferred_bodies);
 
             } break;
             default:
-                fail_at_token("Invalid top-level statement", token_reader.peek());
+                fail_at_token("Invalid top-level statement", token_reader);
+        }
+    }
+
+    //print_ast_node(ast, ast.node(ast.start), 0);
+    //print_ast_node(ast, ast.sibling(ast.node(ast.start)), 0);
+}
+
+static void parse_deferred_body(const TokenStream& tokens, AST& ast, const DeferredBody& body)
+{
+    TokenReader token_reader;
+    token_reader.stream = &tokens;
+    token_reader.position = body.start;
+
+    // The body goes after the parameter list
+    ast.end_children(ast.node(body.function_node)->child);
+    parse_statement_list(token_reader, ast, *body.scope);
+}
+
+static NodeRef rebase(NodeRef ref, const uint32_t* offsets)
+{
+    return ref == NO_NODE ? NO_NODE : ref + offsets[ref >> NODE_POOL_SHIFT];
+}
+
+template <typename T>
+static uint32_t append_pool(std::vector<T>& into, const std::vector<T>& from, uint32_t first, const uint32_t* offsets)
+{
+    assert(into.size() + from.size() <= NODE_INDEX_MASK && "Too many AST nodes");
+
+    for (uint32_t i = first; i < from.size(); ++i)
+    {
+        T node = from[i];
+        node.child = rebase(node.child, offsets);
+        node.sibling = rebase(node.sibling, offsets);
+        into.push_back(node);
+    }
+    return into.size();
+}
+
+// Moves all of from's nodes and arena memory into into. offsets gets what to
+// add to a handle into from to get the same node in into.
+static void merge_ast(AST& into, AST& from, uint32_t* offsets)
+{
+    // from's reserved null node isn't copied
+    offsets[ASTPool::Plain] = into.plain_nodes.size() - 1;
+    offsets[ASTPool::BinOp] = into.binop_nodes.size();
+    offsets[ASTPool::Number] = into.number_nodes.size();
+    offsets[ASTPool::Identifier] = into.identifier_nodes.size();
+    offsets[ASTPool::String] = into.string_nodes.size();
+    offsets[ASTPool::StatementList] = into.statement_list_nodes.size();
+
+    append_pool(into.plain_nodes, from.plain_nodes, 1, offsets);
+    append_pool(into.binop_nodes, from.binop_nodes, 0, offsets);
+    append_pool(into.number_nodes, from.number_nodes, 0, offsets);
+    append_pool(into.identifier_nodes, from.identifier_nodes, 0, offsets);
+    append_pool(into.string_nodes, from.string_nodes, 0, offsets);
+    append_pool(into.statement_list_nodes, from.statement_list_nodes, 0, offsets);
+
+    // Scopes and function infos were allocated in from's arena
+    into.arena.adopt(from.arena);
+}
+
+static void parse_bodies_parallel(const TokenStream& tokens, AST& ast, std::vector<DeferredBody>& bodies, uint32_t worker_count)
+{
+    // Each worker parses into its own AST. The only shared state is the tokens
+    // and the global scope, which is read-only by now.
+    std::unique_ptr<AST[]> worker_asts(new AST[worker_count]);
+    std::atomic<uint32_t> next_body(0);
+
+    std::vector<std::thread> threads;
+    for (uint32_t worker = 0; worker < worker_count; ++worker)
+    {
+        threads.emplace_back([&, worker]() {
+            AST& worker_ast = worker_asts[worker];
+            for (uint32_t i = next_body++; i < bodies.size(); i = next_body++)
+            {
+                DeferredBody& body = bodies[i];
+
+                TokenReader token_reader;
+                token_reader.stream = &tokens;
+                token_reader.position = body.start;
+
+                // Each body is the root of its own tree in the worker's AST
+                worker_ast.attach_owner = NO_NODE;
+                parse_statement_list(token_reader, worker_ast, *body.scope);
+
+                body.worker = worker;
+                body.statement_list_node = worker_ast.start;
+            }
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    std::vector<uint32_t> offsets(worker_count * ASTPool::Count);
+    for (uint32_t worker = 0; worker < worker_count; ++worker)
+    {
+        merge_ast(ast, worker_asts[worker], &offsets[worker * ASTPool::Count]);
+    }
+
+    for (const DeferredBody& body : bodies)
+    {
+        ASTNode* parameter_list = ast.child(ast.node(body.function_node));
+        parameter_list->sibling = rebase(body.statement_list_node, &offsets[body.worker * ASTPool::Count]);
+    }
+}
+
+void parse(const TokenStream& tokens, AST& ast, Scope& global_scope)
+{
+    TokenReader token_reader;
+    token_reader.stream = &tokens;
+
+    // Brace matching finds each function body, so all the signatures
+    // are in the global scope before any body is parsed
+    std::vector<DeferredBody> bodies;
+    parse_top_level(token_reader, ast, global_scope, &bodies);
+
+    uint32_t worker_count = std::min<uint32_t>(std::thread::hardware_concurrency(), bodies.size() / MIN_BODIES_PER_WORKER);
+    if (worker_count > 1)
+    {
+        parse_bodies_parallel(tokens, ast, bodies, worker_count);
+        return;
+    }
+
+    for (const DeferredBody& body : bodies)
+    {
+        parse_deferred_body(tokens, ast, body);
+    }
+}
+
+void LazyParser::init(const TokenStream& tokens_, AST& ast_, Scope& global_scope)
+{
+    tokens = &tokens_;
+    ast = &ast_;
+
+    TokenReader token_reader;
+    token_reader.stream = tokens;
+    parse_top_level(token_reader, *ast, global_scope, &bodies);
+
+    for (uint32_t i = 0; i < bodies.size(); ++i)
+    {
+        const SymbolData* function = static_cast<ASTIdentifierNode*>(ast->node(bodies[i].function_node))->symbol;
+        body_indices[function] = i;
+    }
+}
+
+void LazyParser::reach_roots(Scope& global_scope)
+{
+    SubString main_name;
+    main_name.start = "main";
+    main_name.len = 4;
+
+    SymbolData* main_function = global_scope.lookup_symbol(interner_g.intern(main_name));
+    if (main_function && type_table_g.is_function(main_function->type_id))
+    {
+        reach(main_function);
+        return;
+    }
+
+    for (ASTNode* node = ast->node(ast->start); node; node = ast->sibling(node))
+    {
+        if (node->type == ASTNodeType::FunctionDef)
+        {
+            reach(static_cast<ASTIdentifierNode*>(node)->symbol);
         }
     }
+}
+
+void LazyParser::reach(const SymbolData* function)
+{
+    if (!reached.insert(function).second) return;
+
+    // Declarations and functions nested in other bodies have nothing to parse
+    auto body_index = body_indices.find(function);
+    if (body_index != body_indices.end())
+    {
+        queue.push_back(body_index->second);
+    }
+}
+
+ASTNode* LazyParser::parse_next()
+{
+    if (queue.empty()) return nullptr;
+
+    const DeferredBody& body = bodies[queue.back()];
+    queue.pop_back();
+
+    parse_deferred_body(*tokens, *ast, body);
+
+    // Reach everything called from the body
+    std::vector<ASTNode*> stack;
+    stack.push_back(ast->sibling(ast->child(ast->node(body.function_node))));
+    while (!stack.empty())
+    {
+        ASTNode* node = stack.back();
+        stack.pop_back();
+
+        if (node->type == ASTNodeType::FunctionCall)
+        {
+            // The expression parser only makes calls to identifiers
+            assert(ast->child(node)->type == ASTNodeType::Identifier);
+            reach(static_cast<ASTIdentifierNode*>(ast->child(node))->symbol);
+        }
+
+        for (ASTNode* child = ast->child(node); child; child = ast->sibling(child))
+        {
+            stack.push_back(child);
+        }
+    }
+
+    return ast->node(body.function_node);
+}
+
+void LazyParser::remove_unreached()
+{
+    // Relink the top-level list, skipping unreached functions
+    NodeRef* next_ref = &ast->start;
+    for (NodeRef ref = ast->start; ref != NO_NODE; ref = ast->node(ref)->sibling)
+    {
+        ASTNode* node = ast->node(ref);
+        if (node->type == ASTNodeType::FunctionDef && !reached.count(static_cast<ASTIdentifierNode*>(node)->symbol))
+        {
+            continue;
+        }
+
+        *next_ref = ref;
+        next_ref = &node->sibling;
+    }
+    *next_ref = NO_NODE;
+}
+
+void parse(SourceFile& source, AST& ast, Scope& global_scope)
+{
+    TokenStream tokens;
+    tokens.init_window(TOKEN_WINDOW_SIZE);
+
+    Lexer lexer;
+    lexer.init(source, tokens);
+
+    TokenReader token_reader;
+    token_reader.stream = &tokens;
+    token_reader.lexer = &lexer;
 
-    //print_ast_node(ast.start, global_scope, 0);
-    //print_ast_node(ast.start->sibling, global_scope, 0);
+    parse_top_level(token_reader, ast, global_scope, nullptr);
 }
@@ -2,7 +2,14 @@
 
 #include "lexer.h"
 #include "util.h"
-#include "codegen_llvm.h"
+#include "arena.h"
+#include "intern.h"
+#include "type_table.h"
+#include "codegen_data.h"
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace ASTNodeType
 {
@@ -30,63 +37,82 @@ namespace ASTNodeType
 
 extern const char* AST_NODE_TYPE_NAME[ASTNodeType::Count];
 
-namespace TypeId
+struct SymbolData
 {
-    enum
-    {
-        Invalid,
-        None,
-        U8,
-        I8,
-        U16,
-        I16,
-        U32,
-        I32,
-        U64,
-        I64,
-
-        Bool,
+    uint32_t name_id = StringInterner::EMPTY;
+    SubString name;     // Interned copy of the name, for printing
+    uint32_t type_id = TypeId::Invalid;
+    uint32_t declaration_index = 0;     // Number of symbols declared before it in its scope
 
-        Function,
+    SymbolData_Codegen codegen_data = {};
+};
 
-        Pointer,
+struct Scope
+{
+    Scope* parent = nullptr;
+    Arena* arena = nullptr;
 
-        Count
+    // Open addressing hash table of the symbols declared in this scope, keyed by name id.
+    // The symbols themselves are allocated separately in the arena, so pointers
+    // to them stay valid when the table grows.
+    struct Entry
+    {
+        uint32_t name_id;
+        SymbolData* symbol;     // null if the entry is empty
     };
-}
 
-struct FunctionInfo
-{
-    uint32_t return_type;
-    uint32_t param_count;
-    uint32_t param_types[];
-};
+    Entry* table = nullptr;
+    uint32_t capacity = 0;      // always a power of 2
+    uint32_t count = 0;
 
+    // Only the parent's symbols with a lower declaration index are visible from here.
+    // This lets function bodies be parsed after every top-level signature,
+    // while still only seeing what was declared before them.
+    uint32_t parent_visible_count = UINT32_MAX;
 
-constexpr uint32_t MAX_SYMBOLS = 1024;
-struct SymbolData
-{
-    SubString name;
-    uint32_t type_id = TypeId::Invalid;
-    FunctionInfo* function_info = nullptr;
+    void init(Arena& arena_, Scope* parent_);
+
+    SymbolData* push(uint32_t name_id, uint32_t type_id);
 
-    SymbolData_Codegen codegen_data = nullptr;
+    // Searches this scope, then the parent scopes
+    SymbolData* lookup_symbol(uint32_t name_id);
+
+private:
+    SymbolData* lookup_local(uint32_t name_id);
+    void grow();
 };
 
-struct Scope
+// Handle to a node in an AST. The top bits select the node pool,
+// the rest index into it. Handles stay valid when the pools grow or
+// the AST is copied, unlike pointers.
+typedef uint32_t NodeRef;
+
+constexpr NodeRef NO_NODE = 0;
+
+namespace ASTPool
 {
-    Scope* parent = nullptr;
-    Array<SymbolData> symbols;
+    enum
+    {
+        Plain,
+        BinOp,
+        Number,
+        Identifier,
+        String,
+        StatementList,
 
-    SymbolData* push(SubString name, uint32_t type_id);
-    SymbolData* lookup_symbol(SubString name);
-};
+        Count
+    };
+}
+
+constexpr uint32_t NODE_POOL_SHIFT = 29;
+constexpr uint32_t NODE_INDEX_MASK = (1u << NODE_POOL_SHIFT) - 1;
+static_assert(ASTPool::Count <= (1u << (32 - NODE_POOL_SHIFT)), "Too many node pools");
 
 struct ASTNode
 {
     uint32_t type = ASTNodeType::Invalid;
-    ASTNode* child = nullptr;
-    ASTNode* sibling = nullptr; // next child
+    NodeRef child = NO_NODE;
+    NodeRef sibling = NO_NODE; // next child
 
     ASTNode() = default;
     ASTNode(uint32_t type_): type(type_) {}
@@ -99,6 +125,7 @@ struct ASTBinOpNode : public ASTNode
     //---------------------
     // Set in type checking
     //---------------------
+    uint32_t type_id = TypeId::Invalid;     // of the result
     bool is_signed = false;  // for greater than and less than
 
     ASTBinOpNode(char op_)
@@ -109,6 +136,7 @@ struct ASTBinOpNode : public ASTNode
 
 struct ASTNumberNode: public ASTNode
 {
+    uint32_t type_id = TypeId::Invalid;     // Set in type checking
     uint64_t value;
 
     ASTNumberNode(uint64_t value_)
@@ -138,30 +166,126 @@ struct ASTStringNode: public ASTNode
 
 struct ASTStatementListNode: public ASTNode
 {
-    Scope scope;
+    // Allocated in the AST's arena, since inner scopes point to it as their parent
+    Scope* scope = nullptr;
 
-    ASTStatementListNode(Scope scope_)
-        :ASTNode(ASTNodeType::StatementList),
-        scope(scope_)
+    ASTStatementListNode()
+        :ASTNode(ASTNodeType::StatementList)
     {}
 };
 
 struct AST
 {
-    static const uint32_t MAX_SIZE = 65536;
+    // One pool per node struct, so each node only takes up as much space as
+    // it needs. Element 0 of the plain pool is never used, so that a zero
+    // handle can mean no node.
+    std::vector<ASTNode> plain_nodes;
+    std::vector<ASTBinOpNode> binop_nodes;
+    std::vector<ASTNumberNode> number_nodes;
+    std::vector<ASTIdentifierNode> identifier_nodes;
+    std::vector<ASTStringNode> string_nodes;
+    std::vector<ASTStatementListNode> statement_list_nodes;
+
+    NodeRef start = NO_NODE;
+
+    // The next attached node becomes the child or sibling of attach_owner,
+    // or the start of the AST if there is no owner yet
+    NodeRef attach_owner = NO_NODE;
+    bool attach_as_child = false;
+
+    // Holds function infos and scope storage
+    Arena arena;
+
+    AST();
+
+    // Returns null for NO_NODE. Pointers are invalidated by pushing more nodes.
+    ASTNode* node(NodeRef ref);
+
+    ASTNode* child(const ASTNode* parent)
+    {
+        return node(parent->child);
+    }
+
+    ASTNode* sibling(const ASTNode* prev)
+    {
+        return node(prev->sibling);
+    }
+
+    NodeRef push_orphan(const ASTNode& node);
+    NodeRef push_orphan(const ASTBinOpNode& node);
+    NodeRef push_orphan(const ASTNumberNode& node);
+    NodeRef push_orphan(const ASTIdentifierNode& node);
+    NodeRef push_orphan(const ASTStringNode& node);
+    NodeRef push_orphan(const ASTStatementListNode& node);
+
+    template <typename T>
+    NodeRef push(const T& node)
+    {
+        NodeRef result = push_orphan(node);
+        attach(result);
+
+        return result;
+    }
 
-    uint32_t next = 0;
-    ASTNode* start = nullptr;
-    ASTNode** next_node_ref = &start;
-    uint8_t data[MAX_SIZE];
+    void attach(NodeRef ref);
 
-    ASTNode* push_orphan(const ASTNode& node);
-    ASTNode* push(const ASTNode& node);
-    void attach(ASTNode* node);
+    void begin_children(NodeRef ref);
+    void end_children(NodeRef ref);
 
-    void begin_children(ASTNode* node);
-    void end_children(ASTNode* node);
+    // Empties the AST so it can be reused, keeping the pools' memory
+    void reset();
+
+    // Memory taken up by the node pools
+    uint64_t node_bytes() const;
+};
+
+// A function body which is skipped over while parsing top-level signatures,
+// to be parsed later
+struct DeferredBody
+{
+    NodeRef function_node;      // In the main AST
+    Scope* scope;               // Holds the function's parameters
+    uint32_t start;             // Token index of the opening brace
+
+    // Set once the body is parsed
+    uint32_t worker = 0;        // Which worker AST holds the body
+    NodeRef statement_list_node = NO_NODE;
 };
 
-void parse(const std::vector<Token>& tokens, AST& ast, Scope& global_scope);
+// Parses only top-level signatures up front. A function's body is parsed
+// once the function is reached, either as a root or by a call from a reached
+// function, so unreachable functions are never parsed at all.
+struct LazyParser
+{
+    const TokenStream* tokens = nullptr;
+    AST* ast = nullptr;
+
+    std::vector<DeferredBody> bodies;
+    std::unordered_map<const SymbolData*, uint32_t> body_indices;
+
+    std::unordered_set<const SymbolData*> reached;
+    std::vector<uint32_t> queue;   // Reached bodies which aren't parsed yet
+
+    // Parses the signatures
+    void init(const TokenStream& tokens_, AST& ast_, Scope& global_scope);
+
+    // Reaches main, or every function if there is no main
+    void reach_roots(Scope& global_scope);
+    void reach(const SymbolData* function);
+
+    // Parses the next reached body, and reaches everything it calls.
+    // Returns the function def node, or null once every reached body is parsed.
+    ASTNode* parse_next();
+
+    // Drops top-level functions which were never reached from the AST
+    void remove_unreached();
+};
+
+// Parses tokens which have already been lexed. Top-level signatures are parsed
+// first, then function bodies are parsed in parallel if there are enough of them.
+void parse(const TokenStream& tokens, AST& ast, Scope& global_scope);
+
+// Lexes tokens as the parser needs them, so only a handful of tokens
+// are in memory at once
+void parse(SourceFile& source, AST& ast, Scope& global_scope);
 
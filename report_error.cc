@@ -3,45 +3,25 @@
 #include <iostream>
 #include <cstdlib>
 #include <cassert>
+#include <mutex>
 
 using std::cout;
 using std::endl;
 
-// TODO: This is temporary, obviously we will need multiple files eventually
-const char* file_g = nullptr;
-
-void init_error_reporting(const char* file)
-{
-    file_g = file;
-}
-
-static const char* find_line(uint32_t line_num)
-{
-    uint32_t line_count = 0;
-    uint32_t position = 0;
-    while (line_count < line_num)
-    {
-        assert(file_g[position]);
-
-        if (file_g[position] == '\n')
-        {
-            ++line_count;
-        }
-
-        ++position;
-    }
-
-    return file_g + position;
-}
-
-void compile_assert_with_marker(bool condition, const char* err_msg, uint32_t line_num, uint32_t col_num, uint32_t marker_len)
+void compile_assert_with_marker(bool condition, const char* err_msg, const SourceFile& file, uint32_t line_num, uint32_t col_num, uint32_t marker_len)
 {
     if (!condition)
     {
-        cout << "Line " << line_num + 1 << ": " << err_msg << endl;
+        // The lexer can run on several threads. Only the first error gets
+        // reported, and any other thread failing blocks here until we exit.
+        static std::mutex error_mutex;
+        error_mutex.lock();
 
-        const char* line = find_line(line_num);
-        for (uint32_t col = 0; line[col] != '\n'; ++col)
+        cout << file.path << ": Line " << line_num + 1 << ": " << err_msg << endl;
+
+        assert(line_num < file.line_starts.size());
+        const char* line = file.data + file.line_starts[line_num];
+        for (uint32_t col = 0; line[col] && line[col] != '\n'; ++col)
         {
             cout << line[col];
         }
@@ -62,17 +42,44 @@ void compile_assert_with_marker(bool condition, const char* err_msg, uint32_t li
     }
 }
 
-void compile_fail_with_marker(const char* err_msg, uint32_t line_num, uint32_t col_num, uint32_t marker_len)
+void compile_fail_with_marker(const char* err_msg, const SourceFile& file, uint32_t line_num, uint32_t col_num, uint32_t marker_len)
 {
-    compile_assert_with_marker(false, err_msg, line_num, col_num, marker_len);
+    compile_assert_with_marker(false, err_msg, file, line_num, col_num, marker_len);
 }
 
-void assert_at_token(bool condition, const char* err_msg, Token token)
+void compile_assert_at_offset(bool condition, const char* err_msg, const SourceFile& file, uint32_t offset, uint32_t marker_len)
 {
-    compile_assert_with_marker(condition, err_msg, token.line, token.column, token.len);
+    if (!condition)
+    {
+        uint32_t line_num;
+        uint32_t col_num;
+        file.find_line_and_column(offset, line_num, col_num);
+
+        compile_fail_with_marker(err_msg, file, line_num, col_num, marker_len);
+    }
+}
+
+void compile_fail_at_offset(const char* err_msg, const SourceFile& file, uint32_t offset, uint32_t marker_len)
+{
+    compile_assert_at_offset(false, err_msg, file, offset, marker_len);
+}
+
+void assert_at_token(bool condition, const char* err_msg, const TokenStream& tokens, uint32_t token)
+{
+    if (!condition)
+    {
+        // Tokens past the end (from peeking too far) are reported at the last token
+        if (token >= tokens.size())
+        {
+            assert(tokens.size());
+            token = tokens.size() - 1;
+        }
+
+        compile_fail_at_offset(err_msg, *tokens.source, tokens.offset(token), tokens.len(token));
+    }
 }
 
-void fail_at_token(const char* err_msg, Token token)
+void fail_at_token(const char* err_msg, const TokenStream& tokens, uint32_t token)
 {
-    assert_at_token(false, err_msg, token);
+    assert_at_token(false, err_msg, tokens, token);
 }
@@ -2,12 +2,17 @@
 
 #include <stdint.h>
 #include "lexer.h"
+#include "source_file.h"
 
-// Keep this pointer alive while calling error reporting functions
-void init_error_reporting(const char* file);
+// Errors print the offending line of the file, so it has to stay loaded
+// while calling error reporting functions.
 
-void compile_assert_with_marker(bool condition, const char* err_msg, uint32_t line_num, uint32_t col_num, uint32_t marker_len);
-void compile_fail_with_marker(const char* err_msg, uint32_t line_num, uint32_t col_num, uint32_t marker_len);
+void compile_assert_with_marker(bool condition, const char* err_msg, const SourceFile& file, uint32_t line_num, uint32_t col_num, uint32_t marker_len);
+void compile_fail_with_marker(const char* err_msg, const SourceFile& file, uint32_t line_num, uint32_t col_num, uint32_t marker_len);
 
-void assert_at_token(bool condition, const char* err_msg, Token token);
-void fail_at_token(const char* err_msg, Token token);
+// Offsets are byte offsets into the file, line and column are looked up from them
+void compile_assert_at_offset(bool condition, const char* err_msg, const SourceFile& file, uint32_t offset, uint32_t marker_len);
+void compile_fail_at_offset(const char* err_msg, const SourceFile& file, uint32_t offset, uint32_t marker_len);
+
+void assert_at_token(bool condition, const char* err_msg, const TokenStream& tokens, uint32_t token);
+void fail_at_token(const char* err_msg, const TokenStream& tokens, uint32_t token);
@@ -0,0 +1,146 @@
+#include "source_file.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void fail_to_load(const char* path)
+{
+    std::cout << "Unable to read " << path << ": " << strerror(errno) << std::endl;
+    exit(1);
+}
+
+// Reads fd to the end into a heap buffer with a NUL terminator.
+static void stream_source_file(int fd, SourceFile& file)
+{
+    uint64_t capacity = 64 * 1024;
+    uint64_t len = 0;
+    char* data = (char*)malloc(capacity);
+
+    while (true)
+    {
+        // Always keep room for the terminator
+        if (len + 1 >= capacity)
+        {
+            capacity *= 2;
+            data = (char*)realloc(data, capacity);
+        }
+
+        ssize_t amount = read(fd, data + len, capacity - len - 1);
+        if (amount < 0)
+        {
+            if (errno == EINTR) continue;
+            fail_to_load(file.path);
+        }
+        if (amount == 0) break;
+
+        len += amount;
+    }
+
+    assert(len < UINT32_MAX && "Source file too large");
+
+    data[len] = 0;
+    file.data = data;
+    file.len = len;
+    file.mapped = false;
+}
+
+// Maps the file read-only, followed by at least one zero byte.
+// The kernel zero fills the tail of the last page of a file mapping, but if the
+// file length is an exact multiple of the page size there is no tail, and touching
+// the next page would fault. So we reserve an extra anonymous (zeroed) page
+// past the end and map the file over the front of the reservation.
+static bool map_source_file(int fd, uint64_t len, SourceFile& file)
+{
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t file_pages_len = (len + page_size - 1) / page_size * page_size;
+    uint64_t map_len = file_pages_len + page_size;
+
+    void* reservation = mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reservation == MAP_FAILED) return false;
+
+    void* mapping = mmap(reservation, file_pages_len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        munmap(reservation, map_len);
+        return false;
+    }
+
+    // We read front to back, so let the kernel read ahead aggressively
+    madvise(mapping, file_pages_len, MADV_SEQUENTIAL);
+
+    file.data = (const char*)mapping;
+    file.len = len;
+    file.mapped = true;
+    file.map_len = map_len;
+
+    assert(file.data[len] == 0);
+    return true;
+}
+
+void load_source_file(const char* path, SourceFile& file)
+{
+    file.path = path;
+
+    if (strcmp(path, "-") == 0)
+    {
+        file.path = "<stdin>";
+        stream_source_file(STDIN_FILENO, file);
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) fail_to_load(path);
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) fail_to_load(path);
+
+    // Empty files can't be mapped, and pipes etc. have no meaningful size
+    bool mappable = S_ISREG(file_stat.st_mode) && file_stat.st_size > 0;
+    if (mappable)
+    {
+        assert((uint64_t)file_stat.st_size < UINT32_MAX && "Source file too large");
+    }
+
+    if (!mappable || !map_source_file(fd, file_stat.st_size, file))
+    {
+        stream_source_file(fd, file);
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+}
+
+void close_source_file(SourceFile& file)
+{
+    if (file.mapped)
+    {
+        munmap((void*)file.data, file.map_len);
+    }
+    else
+    {
+        free((void*)file.data);
+    }
+
+    file.data = nullptr;
+    file.len = 0;
+}
+
+void SourceFile::find_line_and_column(uint32_t offset, uint32_t& line, uint32_t& column) const
+{
+    assert(line_starts.size() && line_starts[0] == 0);
+
+    // First line start after offset, the line containing offset is the one before it
+    auto next_line = std::upper_bound(line_starts.begin(), line_starts.end(), offset);
+
+    line = (next_line - line_starts.begin()) - 1;
+    column = offset - line_starts[line];
+}
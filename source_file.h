@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// A source file loaded into memory. data[len] is always a readable NUL byte,
+// which the lexer and error reporting rely on to find the end of the file.
+// Tokens and AST nodes borrow SubStrings straight out of data, so the file
+// must stay loaded until codegen has finished.
+struct SourceFile
+{
+    const char* path = nullptr;
+    const char* data = nullptr;
+    uint32_t len = 0;
+
+    // Set if data points into a read-only file mapping, otherwise data
+    // was allocated by a streaming read.
+    bool mapped = false;
+    uint64_t map_len = 0;
+
+    // Offset of the first byte of each line, filled in by the lexer
+    std::vector<uint32_t> line_starts;
+
+    // Both zero based. Binary searches line_starts.
+    void find_line_and_column(uint32_t offset, uint32_t& line, uint32_t& column) const;
+};
+
+// Regular files are memory mapped; stdin ("-"), pipes and anything else that
+// can't be mapped fall back to a streaming read.
+// Prints an error and exits if the file can't be read.
+void load_source_file(const char* path, SourceFile& file);
+void close_source_file(SourceFile& file);
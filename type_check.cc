@@ -1,14 +1,17 @@
 #include "type_check.h"
 
-static void set_statement_list_type_info(ASTNode* statement);
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
-static bool is_signed_integer(uint32_t type_id)
-{
-    return type_id == TypeId::I8
-        || type_id == TypeId::I16
-        || type_id == TypeId::I32
-        || type_id == TypeId::I64;
-}
+// Checking on more threads isn't worth it for fewer functions than this
+constexpr uint32_t MIN_FUNCTIONS_PER_WORKER = 64;
+
+// Functions handed to a worker at a time
+constexpr uint32_t FUNCTION_BATCH_SIZE = 16;
+
+static void set_statement_list_type_info(AST& ast, ASTNode* statement, uint32_t return_type);
 
 static uint32_t deduce_binop_result_type(uint32_t op, uint32_t lhs_type, uint32_t rhs_type)
 {
@@ -35,72 +38,324 @@ static void set_binop_type_info(ASTBinOpNode* binop, uint32_t lhs_type, uint32_t
     }
 }
 
-static uint32_t set_expr_type_info(ASTNode* expr)
+// Invalid past the last parameter, for when asserts are off
+static uint32_t get_param_type(const TypeInfo& info, uint32_t param_index)
 {
-    switch (expr->type)
+    if (param_index < info.param_count)
     {
-        case ASTNodeType::Number:
-            return TypeId::U32;
-        case ASTNodeType::Identifier:
-            return static_cast<ASTIdentifierNode*>(expr)->symbol->type_id;
-        case ASTNodeType::BinaryOperator: {
-            uint32_t lhs_type = set_expr_type_info(expr->child);
-            uint32_t rhs_type = set_expr_type_info(expr->child->sibling);
+        return info.param_types[param_index];
+    }
+    return TypeId::Invalid;
+}
 
-            set_binop_type_info(static_cast<ASTBinOpNode*>(expr), lhs_type, rhs_type);
+// Gives every number in a subtree made only of numbers and arithmetic the type
+// of the other operand, once that's known. Such subtrees can't contain calls,
+// so they're walked with an explicit stack like everything else here.
+static void set_literal_type(AST& ast, ASTNode* expr, uint32_t type_id)
+{
+    std::vector<ASTNode*> stack(1, expr);
+    while (!stack.empty())
+    {
+        ASTNode* node = stack.back();
+        stack.pop_back();
 
-            return deduce_binop_result_type(static_cast<ASTBinOpNode*>(expr)->op, lhs_type, rhs_type);
+        if (node->type == ASTNodeType::Number)
+        {
+            static_cast<ASTNumberNode*>(node)->type_id = type_id;
+            continue;
+        }
+
+        static_cast<ASTBinOpNode*>(node)->type_id = type_id;
+        for (ASTNode* child = ast.child(node); child; child = ast.sibling(child))
+        {
+            stack.push_back(child);
+        }
+    }
+}
+
+struct TypeCheckFrame
+{
+    ASTNode* expr;
+    uint32_t operand_expected_type;     // For binary operators
+    uint32_t operands_done;
+    uint32_t lhs_type;                  // For binary operators
+    bool lhs_literal;
+    ASTNode* next_arg;                  // For calls
+};
+
+// Kept between calls to avoid allocating for every expression
+static thread_local std::vector<TypeCheckFrame> type_check_frames;
+
+// expected_type is the type the context wants, or Invalid if it doesn't care.
+// Number literals take the expected type if it's an integer type, or u32 otherwise.
+// An operand made only of literals, like (3 + 4), takes the type of the other
+// operand instead, on either side.
+// Expressions can be nested arbitrarily deep, so this keeps an explicit stack
+// of the operators and calls being checked instead of recursing.
+static uint32_t set_expr_type_info(AST& ast, ASTNode* expr, uint32_t expected_type)
+{
+    std::vector<TypeCheckFrame>& frames = type_check_frames;
+    frames.clear();
+
+    // The next subexpression to check, and the type of the last one checked
+    ASTNode* pending = expr;
+    uint32_t pending_expected_type = expected_type;
+    uint32_t result = TypeId::Invalid;
+    bool result_literal = false;    // Only numbers and arithmetic on them
+
+    while (true)
+    {
+        ASTNode* subexpr = pending;
+        pending = nullptr;
+
+        switch (subexpr->type)
+        {
+            case ASTNodeType::Number: {
+                uint32_t type_id = TypeId::U32;
+                if (is_integer(pending_expected_type))
+                {
+                    type_id = pending_expected_type;
+                }
+                static_cast<ASTNumberNode*>(subexpr)->type_id = type_id;
+                result = type_id;
+                result_literal = true;
+            } break;
+            case ASTNodeType::String:
+                result = TypeId::Pointer;
+                result_literal = false;
+                break;
+            case ASTNodeType::Identifier:
+                result = static_cast<ASTIdentifierNode*>(subexpr)->symbol->type_id;
+                result_literal = false;
+                break;
+            case ASTNodeType::BinaryOperator: {
+                ASTBinOpNode* binop = static_cast<ASTBinOpNode*>(subexpr);
+
+                TypeCheckFrame frame = {};
+                frame.expr = subexpr;
+
+                // Comparisons produce a bool, so their operands don't get the expected type
+                frame.operand_expected_type = pending_expected_type;
+                if (binop->op == '<' || binop->op == '>')
+                {
+                    frame.operand_expected_type = TypeId::Invalid;
+                }
+
+                frames.push_back(frame);
+
+                pending = ast.child(subexpr);
+                pending_expected_type = frame.operand_expected_type;
+                continue;
+            }
+            case ASTNodeType::FunctionCall: {
+                ASTNode* function = ast.child(subexpr);
+                SymbolData* symbol = static_cast<ASTIdentifierNode*>(function)->symbol;
+                assert(type_table_g.is_function(symbol->type_id) && "Calling something which isn't a function");
+
+                TypeCheckFrame frame = {};
+                frame.expr = subexpr;
+                frame.next_arg = ast.sibling(function);
+                frames.push_back(frame);
+            } break;
+            default:
+                result = TypeId::Invalid;
+                result_literal = false;
+        }
+
+        // Hand finished subexpressions to the frames waiting on them,
+        // until one of them needs another operand checked
+        while (!pending)
+        {
+            if (frames.empty())
+            {
+                return result;
+            }
+
+            TypeCheckFrame& frame = frames.back();
+            if (frame.expr->type == ASTNodeType::BinaryOperator)
+            {
+                ASTNode* lhs = ast.child(frame.expr);
+
+                // A literal rhs takes the type of the lhs straight away
+                if (frame.operands_done == 0)
+                {
+                    frame.operands_done = 1;
+                    frame.lhs_type = result;
+                    frame.lhs_literal = result_literal;
+
+                    pending = ast.sibling(lhs);
+                    pending_expected_type = result;
+                    continue;
+                }
+
+                // A literal lhs only finds out its type from the rhs
+                uint32_t lhs_type = frame.lhs_type;
+                uint32_t rhs_type = result;
+                if (frame.lhs_literal && !result_literal && lhs_type != rhs_type && is_integer(rhs_type))
+                {
+                    set_literal_type(ast, lhs, rhs_type);
+                    lhs_type = rhs_type;
+                }
+
+                ASTBinOpNode* binop = static_cast<ASTBinOpNode*>(frame.expr);
+                set_binop_type_info(binop, lhs_type, rhs_type);
+
+                binop->type_id = deduce_binop_result_type(binop->op, lhs_type, rhs_type);
+                result = binop->type_id;
+
+                // Comparisons are always bools, so they can't take another type
+                bool is_comparison = binop->op == '<' || binop->op == '>';
+                result_literal = frame.lhs_literal && result_literal && !is_comparison;
+            }
+            else
+            {
+                SymbolData* symbol = static_cast<ASTIdentifierNode*>(ast.child(frame.expr))->symbol;
+                const TypeInfo& info = type_table_g.get(symbol->type_id);
+
+                // The argument before this one has just been checked
+                if (frame.operands_done > 0)
+                {
+                    uint32_t param_index = frame.operands_done - 1;
+                    uint32_t param_type = get_param_type(info, param_index);
+                    assert((param_type == TypeId::Invalid || result == param_type) && "Argument type doesn't match the parameter");
+                    (void)param_type;
+                }
+
+                if (frame.next_arg)
+                {
+                    assert(frame.operands_done < info.param_count && "Too many arguments");
+
+                    pending = frame.next_arg;
+                    pending_expected_type = get_param_type(info, frame.operands_done);
+
+                    frame.next_arg = ast.sibling(frame.next_arg);
+                    ++frame.operands_done;
+                    continue;
+                }
+
+                assert(frame.operands_done == info.param_count && "Too few arguments");
+
+                result = info.base;
+                result_literal = false;
+            }
+
+            frames.pop_back();
         }
-        default:
-            return TypeId::Invalid;
     }
 }
 
-static void set_statement_type_info(ASTNode* statement)
+static void set_statement_type_info(AST& ast, ASTNode* statement, uint32_t return_type)
 {
     // TODO: need proper error messages here - can't do that without tokens currently
     switch (statement->type)
     {
         case ASTNodeType::VariableDef:
-        case ASTNodeType::Assignment:
-            assert(static_cast<ASTIdentifierNode*>(statement)->symbol->type_id == set_expr_type_info(statement->child));
-            break;
+        case ASTNodeType::Assignment: {
+            uint32_t type_id = static_cast<ASTIdentifierNode*>(statement)->symbol->type_id;
+            uint32_t expr_type_id = set_expr_type_info(ast, ast.child(statement), type_id);
+            assert(expr_type_id == type_id);
+            (void)expr_type_id;
+        } break;
         case ASTNodeType::Return:
             if (statement->child)
             {
-                set_expr_type_info(statement->child);
+                assert(return_type != TypeId::None && "Returning a value from a function without a return type");
+                uint32_t type_id = set_expr_type_info(ast, ast.child(statement), return_type);
+                assert(type_id == return_type && "Returned value doesn't match the return type");
+                (void)type_id;
+            }
+            else
+            {
+                assert(return_type == TypeId::None && "Missing return value");
             }
             break;
         case ASTNodeType::If:
-        case ASTNodeType::While:
-            assert(set_expr_type_info(statement->child) == TypeId::Bool);
-            set_statement_list_type_info(statement->child->sibling);
+        case ASTNodeType::While: {
+            ASTNode* condition = ast.child(statement);
+            uint32_t condition_type_id = set_expr_type_info(ast, condition, TypeId::Bool);
+            assert(condition_type_id == TypeId::Bool);
+            (void)condition_type_id;
+
+            // Block, then the else block if there is one
+            for (ASTNode* block = ast.sibling(condition); block; block = ast.sibling(block))
+            {
+                set_statement_list_type_info(ast, block, return_type);
+            }
+        } break;
+        case ASTNodeType::FunctionCall:
+            set_expr_type_info(ast, statement, TypeId::Invalid);
             break;
         default:
             assert(false && "Unsupported");
     }
 }
 
-static void set_statement_list_type_info(ASTNode* statement_list)
+static void set_statement_list_type_info(AST& ast, ASTNode* statement_list, uint32_t return_type)
 {
     assert(statement_list->type == ASTNodeType::StatementList);
-    ASTNode* statement = statement_list->child;
+    ASTNode* statement = ast.child(statement_list);
     while (statement)
     {
-        set_statement_type_info(statement);
-        statement = statement->sibling;
+        set_statement_type_info(ast, statement, return_type);
+        statement = ast.sibling(statement);
     }
 }
 
-void set_ast_type_info(AST& ast)
+void set_function_type_info(AST& ast, ASTNode* function_def)
 {
-    // TODO: This only does one function?
-    assert(ast.start->type == ASTNodeType::FunctionDef);
+    assert(function_def->type == ASTNodeType::FunctionDef);
 
-    ASTNode* statement_list = ast.start->child->sibling;
+    ASTNode* statement_list = ast.sibling(ast.child(function_def));
 
     if (statement_list)
     {
-        set_statement_list_type_info(statement_list);
+        uint32_t return_type = type_table_g.get(static_cast<ASTIdentifierNode*>(function_def)->symbol->type_id).base;
+        set_statement_list_type_info(ast, statement_list, return_type);
+    }
+}
+
+void set_ast_type_info(AST& ast)
+{
+    std::vector<ASTNode*> functions;
+    for (ASTNode* node = ast.node(ast.start); node; node = ast.sibling(node))
+    {
+        if (node->type == ASTNodeType::FunctionDef)
+        {
+            functions.push_back(node);
+        }
+    }
+
+    uint32_t worker_count = std::min<uint32_t>(std::thread::hardware_concurrency(), functions.size() / MIN_FUNCTIONS_PER_WORKER);
+    if (worker_count <= 1)
+    {
+        for (ASTNode* function_def : functions)
+        {
+            set_function_type_info(ast, function_def);
+        }
+        return;
+    }
+
+    // Bodies don't share any nodes, and results only go into each body's own
+    // nodes, so functions can be checked in any order on any thread.
+    // Workers grab batches from a shared counter until they run out.
+    std::atomic<uint32_t> next_function(0);
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < worker_count; ++i)
+    {
+        threads.emplace_back([&]() {
+            while (true)
+            {
+                uint32_t start = next_function.fetch_add(FUNCTION_BATCH_SIZE);
+                if (start >= functions.size()) break;
+
+                uint32_t end = std::min<uint32_t>(start + FUNCTION_BATCH_SIZE, functions.size());
+                for (uint32_t j = start; j < end; ++j)
+                {
+                    set_function_type_info(ast, functions[j]);
+                }
+            }
+        });
     }
+    for (std::thread& thread : threads) thread.join();
 }
@@ -1,4 +1,9 @@
 #pragma once
 #include "parser.h"
 
+// Type checks every top-level function, across threads if there are enough of them.
+// The results only depend on the AST, not on how the work was split up.
 void set_ast_type_info(AST& ast);
+
+// Type checks the body of one function, if it has one
+void set_function_type_info(AST& ast, ASTNode* function_def);
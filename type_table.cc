@@ -0,0 +1,137 @@
+#include "type_table.h"
+
+#include <cstring>
+#include <cassert>
+
+TypeTable type_table_g;
+
+static uint32_t hash_type(const TypeInfo& info)
+{
+    // FNV-1a over the fields and param types
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](uint32_t value)
+    {
+        hash = (hash ^ value) * 16777619u;
+    };
+
+    mix(info.kind);
+    mix(info.base);
+    mix(info.param_count);
+    for (uint32_t i = 0; i < info.param_count; ++i)
+    {
+        mix(info.param_types[i]);
+    }
+
+    return hash;
+}
+
+static bool same_type(const TypeInfo& a, const TypeInfo& b)
+{
+    return a.kind == b.kind
+        && a.base == b.base
+        && a.param_count == b.param_count
+        && (!a.param_count || !memcmp(a.param_types, b.param_types, 4 * a.param_count));
+}
+
+TypeTable::TypeTable()
+{
+    // There aren't many distinct signatures, so a smaller block size is fine
+    pool.block_size = 64 * 1024;
+    table.resize(256);
+
+    // Builtins are told apart by their base, which is their own id
+    for (uint32_t id = 0; id < TypeId::Pointer; ++id)
+    {
+        TypeInfo info = {};
+        info.kind = TypeKind::Builtin;
+        info.base = id;
+
+        uint32_t interned = intern(info);
+        assert(interned == id);
+        (void)interned;
+    }
+
+    uint32_t pointer = pointer_to(TypeId::U8);
+    assert(pointer == TypeId::Pointer);
+    (void)pointer;
+}
+
+uint32_t TypeTable::pointer_to(uint32_t pointee)
+{
+    TypeInfo info = {};
+    info.kind = TypeKind::Pointer;
+    info.base = pointee;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return intern(info);
+}
+
+uint32_t TypeTable::function(uint32_t return_type, const uint32_t* param_types, uint32_t param_count)
+{
+    TypeInfo info;
+    info.kind = TypeKind::Function;
+    info.base = return_type;
+    info.param_count = param_count;
+    info.param_types = param_types;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return intern(info);
+}
+
+uint32_t TypeTable::intern(const TypeInfo& info)
+{
+    uint32_t hash = hash_type(info);
+
+    uint32_t mask = table.size() - 1;
+    uint32_t slot = hash & mask;
+    for (; table[slot]; slot = (slot + 1) & mask)
+    {
+        uint32_t id = table[slot] - 1;
+        if (hashes[id] == hash && same_type(types[id], info))
+        {
+            return id;
+        }
+    }
+
+    // New type, copy the param types into the pool since the caller's may not last
+    TypeInfo pooled = info;
+    if (info.param_count)
+    {
+        uint32_t* param_types = (uint32_t*)pool.alloc(4 * info.param_count, alignof(uint32_t));
+        memcpy(param_types, info.param_types, 4 * info.param_count);
+        pooled.param_types = param_types;
+    }
+    else
+    {
+        pooled.param_types = nullptr;
+    }
+
+    uint32_t id = types.size();
+    types.push_back(pooled);
+    hashes.push_back(hash);
+    table[slot] = id + 1;
+
+    // Keep the load factor at most 1/2
+    if (2 * types.size() > table.size())
+    {
+        grow();
+    }
+
+    return id;
+}
+
+void TypeTable::grow()
+{
+    table.assign(table.size() * 2, 0);
+
+    uint32_t mask = table.size() - 1;
+    for (uint32_t id = 0; id < types.size(); ++id)
+    {
+        uint32_t slot = hashes[id] & mask;
+        while (table[slot])
+        {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = id + 1;
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "arena.h"
+#include <vector>
+#include <mutex>
+#include <stdint.h>
+
+// Ids of the builtin types, which are interned up front in this order
+namespace TypeId
+{
+    enum
+    {
+        Invalid,
+        None,
+        U8,
+        I8,
+        U16,
+        I16,
+        U32,
+        I32,
+        U64,
+        I64,
+
+        Bool,
+
+        // The pointer type name, which is a pointer to u8
+        Pointer,
+
+        Count
+    };
+}
+
+inline bool is_integer(uint32_t type_id)
+{
+    return type_id >= TypeId::U8 && type_id <= TypeId::I64;
+}
+
+inline bool is_signed_integer(uint32_t type_id)
+{
+    return type_id == TypeId::I8
+        || type_id == TypeId::I16
+        || type_id == TypeId::I32
+        || type_id == TypeId::I64;
+}
+
+// Bool is 1 bit, pointers are 64
+inline uint32_t type_bits(uint32_t type_id)
+{
+    switch (type_id)
+    {
+        case TypeId::Bool:
+            return 1;
+        case TypeId::U8:
+        case TypeId::I8:
+            return 8;
+        case TypeId::U16:
+        case TypeId::I16:
+            return 16;
+        case TypeId::U32:
+        case TypeId::I32:
+            return 32;
+        default:
+            return 64;
+    }
+}
+
+namespace TypeKind
+{
+    enum
+    {
+        Builtin,
+        Pointer,
+        Function,
+    };
+}
+
+struct TypeInfo
+{
+    uint32_t kind;
+    uint32_t base;      // Pointee, or return type for functions
+    uint32_t param_count;
+    const uint32_t* param_types;
+};
+
+// Every type gets a dense id, and structurally equal types get the same id,
+// so types are compared with a single integer compare and identical function
+// signatures share one TypeInfo.
+// Interning is thread safe, but get must not run while another thread is interning,
+// so types should be looked up only once parsing is done.
+struct TypeTable
+{
+    TypeTable();
+
+    uint32_t pointer_to(uint32_t pointee);
+    uint32_t function(uint32_t return_type, const uint32_t* param_types, uint32_t param_count);
+
+    const TypeInfo& get(uint32_t id) const
+    {
+        return types[id];
+    }
+
+    bool is_function(uint32_t id) const
+    {
+        return types[id].kind == TypeKind::Function;
+    }
+
+    uint32_t size() const
+    {
+        return types.size();
+    }
+
+private:
+    std::mutex mutex;
+    Arena pool;     // Param type lists
+    std::vector<TypeInfo> types;
+    std::vector<uint32_t> hashes;
+
+    // Open addressing hash table of id + 1, zero if the entry is empty
+    std::vector<uint32_t> table;
+
+    uint32_t intern(const TypeInfo& info);
+    void grow();
+};
+
+// Types from all source files
+extern TypeTable type_table_g;
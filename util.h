@@ -68,6 +68,8 @@ struct SubString
 
     void print() const;
     bool operator==(const SubString& rhs);
+
+    uint32_t hash() const;
 };
 
 bool operator==(const SubString& lhs, const char* rhs);